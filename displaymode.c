@@ -15,20 +15,41 @@
 // limitations under the License.
 //
 // Compilation:
-//   clang -std=c11 -lm -framework CoreFoundation -framework CoreGraphics -o displaymode displaymode.c
+//   clang -std=c11 -lm -framework ColorSync -framework CoreFoundation -framework CoreGraphics -o displaymode displaymode.c
 //
 // Usage (to change the resolution to 1440x900):
 //   displaymode t 1440 900
 
 #include <errno.h>
+#include <fcntl.h>
 #include <math.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sysctl.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
 
+#include <ColorSync/ColorSync.h>
+#include <CommonCrypto/CommonHMAC.h>
 #include <CoreFoundation/CoreFoundation.h>
 #include <CoreGraphics/CoreGraphics.h>
 #include <MacTypes.h>
+#include <dispatch/dispatch.h>
+
+#if __has_include(<os/signpost.h>)
+#include <os/signpost.h>
+#define DISPLAYMODE_HAVE_SIGNPOST 1
+#endif
 
 // Name and version to display with "v" option.
 static const char kProgramVersion[] = "displaymode 1.4.0";
@@ -41,101 +62,896 @@ enum Option {
     kOptionMissing = 0,
     kOptionInvalid = 1,
     kOptionInvalidMode = 2,
+    kOptionPipeline = '-',
+    kOptionBenchmark = 'b',
+    kOptionCurrentMode = 'c',
     kOptionSupportedModes = 'd',
+    kOptionFleet = 'f',
     kOptionHelp = 'h',
+    kOptionCapture = 'k',
+    kOptionProfile = 'p',
+    kOptionRun = 'r',
+    kOptionServer = 's',
     kOptionConfigureMode = 't',
     kOptionVersion = 'v',
+    kOptionWatch = 'w',
 };
 
 // Positions in argv of various expected parameters.
 enum {
     kArgvOptionIndex = 1,
-    kArgvWidthIndex = 2,
-    kArgvHeightIndex = 3,
-    kArgvRefreshOrDisplayIndex = 4,
+    kArgvModeIndex = 2,
+    kArgvDisplayIndex = 2,
+    kArgvSocketIndex = 2,
+    kArgvProfileIndex = 2,
+    kArgvSavedProfileIndex = 3,
+    kArgvHostsIndex = 2,
+    kArgvFleetCommandIndex = 3,
 };
 
-static const uint32_t kMaxDisplays = 32;
+// Positions of the words in a profile line, after SplitCommandLine.
+enum {
+    kProfileDisplayIndex = 1,
+    kProfileModeIndex = 2,
+};
 
-// Represents the command-line arguments after parsing.
-struct ParsedArgs {
-    enum Option option;
-    const char * literal_option;
+// Positions of the parameters in a mode specification, relative to its start.
+enum {
+    kModeWidthOffset = 0,
+    kModeHeightOffset = 1,
+    kModeRefreshOrDisplayOffset = 2,
+};
+
+enum { kMaxDisplays = 32 };
+
+// Maximum number of modes that --fallback may list.
+enum { kMaxFallbacks = 8 };
+
+// Default maximum time to wait for reconfigured displays to settle.
+static const CFTimeInterval kSettleTimeout = 10.0;
+
+// Maximum length of a command line read by the server, including the newline.
+enum { kMaxCommandLength = 1024 };
+
+// Maximum number of words in a command line read by the server, including the
+// placeholder program name.  Every word takes at least two characters with
+// its separator, so this fits any line of kMaxCommandLength, which is enough
+// for kMaxDisplays full mode specifications and flags.
+enum { kMaxCommandArgs = kMaxCommandLength / 2 + 1 };
+
+// Formats for listing modes.
+enum OutputFormat {
+    kFormatText = 0,
+    kFormatJSON,  // JSON Lines: one object per mode
+    kFormatTSV,  // tab-separated values with a header row
+};
+
+// How long configuration changes last.
+enum ConfigureScope {
+    kScopeDefault = 0,  // permanent, or the server's scope for its commands
+    kScopePermanent,  // saved in the user's preferences
+    kScopeSession,  // until the user logs out
+    kScopeApp,  // until displaymode exits
+};
+
+// What to favour when choosing the best mode rather than an exact match.
+enum Preference {
+    kPreferResolution = 0,
+    kPreferRefresh,
+    kPreferHiDPI,
+};
+
+// The vendor, model and serial numbers of a display.  Unlike its index in
+// the active display list, these do not change when displays are added or
+// removed.
+struct DisplayIdentity {
+    uint32_t vendor;
+    uint32_t model;
+    uint32_t serial;
+};
+
+// How a display is named in a mode specification.
+enum DisplaySelector {
+    kSelectDisplayIndex = 0,  // index in the active display list
+    kSelectDisplayID,  // CGDirectDisplayID, e.g. "id:69733378"
+    kSelectDisplayUUID,  // e.g. "37D8832A-2D66-02CA-B9F7-8F30A301B230"
+    kSelectDisplayIdentity,  // vendor-model-serial, e.g. "610-a050-0"
+};
+
+// A display named other than by index.
+struct DisplayName {
+    enum DisplaySelector selector;
+    CGDirectDisplayID display_id;
+    CFUUIDBytes uuid;
+    struct DisplayIdentity identity;
+};
+
+// Whether to change which display a display mirrors.
+enum MirrorRequest {
+    kMirrorUnchanged = 0,
+    kMirrorDisplay,  // "mirror:<display>"
+    kMirrorNone,  // "mirror:none", to stop mirroring
+};
+
+// Which refresh rate to pick among the modes with the requested resolution.
+enum RefreshPick {
+    kRefreshPickExact = 0,  // the given rate, or the first mode for any
+    kRefreshPickHighest,  // "@max", or a range such as "@100-144"
+    kRefreshPickLowest,  // "@min"
+};
+
+// A requested mode for a single display.
+struct ModeSpec {
     unsigned long width;
     unsigned long height;
     double refresh_rate;  // 0.0 for any
+    // Unless refresh_pick is kRefreshPickExact, the rates allowed, with 0.0
+    // for no limit.
+    enum RefreshPick refresh_pick;
+    double min_refresh_rate;
+    double max_refresh_rate;
+    double scale;  // pixels per point, 0.0 for any
     uint32_t display_index;
+    // Unless display.selector is kSelectDisplayIndex, display_index is only
+    // set once the display it names is found.
+    struct DisplayName display;
+    // The display to mirror, found like display_index.
+    enum MirrorRequest mirror;
+    uint32_t mirror_index;
+    struct DisplayName mirror_of;
+    // Where to place the display's top-left corner in global coordinates.
+    bool set_origin;
+    int32_t origin_x;
+    int32_t origin_y;
+    // Choose the closest mode instead of requiring an exact match.
+    bool best;
+    enum Preference prefer;
+    // If limit_bandwidth, the most scanout bandwidth the mode may use in
+    // bytes per second.
+    bool limit_bandwidth;
+    double max_bandwidth;
+};
+
+// Represents the command-line arguments after parsing.
+struct ParsedArgs {
+    enum Option option;
+    const char * literal_option;
+    // Modes to configure together, at most one per display.
+    uint32_t num_modes;
+    struct ModeSpec modes[kMaxDisplays];
+    // Modes to try in turn if the only mode can't be found or set.
+    const char * fallback;  // the unparsed --fallback list
+    uint32_t num_fallbacks;
+    struct ModeSpec fallbacks[kMaxFallbacks];
+    // Displays named for "c" and "d"; every display if none are.
+    uint32_t num_displays;
+    uint32_t display_indexes[kMaxDisplays];
+    struct DisplayName displays[kMaxDisplays];
+    const char * socket_path;
+    const char * profile_path;
+    // The command to run while the displays are held, or NULL.
+    const char * const * command;
+    int command_argc;
+    bool save_profile;  // save to profile_path instead of applying it
+    // Directory for the on-disk mode cache; NULL if disabled, or empty for the
+    // default directory.
+    const char * cache_dir;
+    // Reconfigure displays even if the requested mode is already current.
+    bool force;
+    // Give mirroring displays the mode of the display they mirror where
+    // possible, so that they can be mirrored in hardware.
+    bool hw_mirror;
+    // Resolve and report the modes that would be set without changing them.
+    bool dry_run;
+    // Limit on the total scanout bandwidth of all active displays in bytes
+    // per second, or 0.0 for no limit.
+    double max_bandwidth;
+    // Report how long each phase of the command took.
+    bool timings;
+    bool low_resolution;  // include duplicate low-resolution modes
+    // Number of times to repeat each benchmark; 0 for the default.
+    unsigned long iterations;
+    // Seconds to wait for reconfigured displays to settle; 0 to not wait.
+    double wait_timeout;
+    enum OutputFormat format;
+    enum Preference prefer;
+    enum ConfigureScope scope;
+    // Fade out and in for these many seconds when reconfiguring, instead of
+    // the system's default fade.
+    bool fade;
+    double fade_out;
+    double fade_in;
+    // File of hosts for "f", and of the shared secret for "f" and "s tcp:".
+    const char * hosts_path;
+    const char * token_path;
+    // Maximum number of hosts "f" talks to at once; 0 for the default.
+    unsigned long concurrency;
+};
+
+// The properties of a display mode needed to list or match it.
+struct ModeInfo {
+    uint32_t width;
+    uint32_t height;
+    uint32_t pixel_width;
+    uint32_t pixel_height;
+    double refresh_rate;
+    int32_t io_mode_id;
+    uint32_t io_flags;
+    uint32_t usable_for_desktop;
+};
+
+// The modes of a display, stored column-wise in CGDisplayCopyAllDisplayModes
+// order so that row i describes element i of the mode array.
+// `by_resolution' lists the rows ordered by width, height and then row, so
+// that a resolution can be found by binary search.
+struct ModeTable {
+    size_t count;
+    bool from_cache;  // rows may not correspond to a copied mode array
+    uint32_t * widths;
+    uint32_t * heights;
+    uint32_t * pixel_widths;
+    uint32_t * pixel_heights;
+    double * refresh_rates;
+    int32_t * io_mode_ids;
+    uint32_t * io_flags;
+    uint8_t * usable_for_desktop;
+    uint32_t * by_resolution;
+};
+
+// Display list and mode lists that can be reused between commands.
+//
+// A one-shot invocation fills this in lazily and discards it; the server keeps
+// it for its lifetime so that commands skip CGGetActiveDisplayList and
+// CGDisplayCopyAllDisplayModes.
+struct DisplayState {
+    bool has_displays;
+    uint32_t num_displays;
+    CGDirectDisplayID displays[kMaxDisplays];
+    CFArrayRef modes[kMaxDisplays];  // NULL until copied
+    struct ModeTable * mode_tables[kMaxDisplays];  // NULL until loaded
+    CFDictionaryRef mode_options;  // that `modes' were copied with
+    // Current modes, NULL until copied.  Unlike the mode lists, these are
+    // discarded before each command and whenever displays are reconfigured.
+    CGDisplayModeRef current_modes[kMaxDisplays];
+};
+
+// Phases of a command that are timed for --timings and marked with signpost
+// intervals for Instruments.
+enum Phase {
+    kPhaseDisplayList,
+    kPhaseEnumeration,
+    kPhaseModeTable,
+    kPhaseMatching,
+    kPhaseConfigure,
+    kPhaseCommit,
+    kPhaseSettle,
+    kNumPhases,
+};
+
+static const char * const kPhaseNames[kNumPhases] = {
+    [kPhaseDisplayList] = "display-list",
+    [kPhaseEnumeration] = "enumeration",
+    [kPhaseModeTable] = "mode-table",
+    [kPhaseMatching] = "matching",
+    [kPhaseConfigure] = "configure",
+    [kPhaseCommit] = "commit",
+    [kPhaseSettle] = "settle",
+};
+
+// Total time spent in each phase of a command.
+struct Timings {
+    uint64_t nanoseconds[kNumPhases];
+    uint32_t counts[kNumPhases];
+};
+
+// The streams and state used to execute a command.
+struct Session {
+    FILE * out;
+    FILE * err;
+    struct DisplayState * state;
+    struct Timings * timings;  // NULL unless --timings was given
+    // Unless NULL, set once a display configuration is completed, even if
+    // completing it fails, since that may still reconfigure some displays.
+    bool * reconfigured;
+    // Options for CGDisplayCopyAllDisplayModes; NULL for the default modes.
+    CFDictionaryRef mode_options;
+};
+
+// A phase that has begun but not yet ended.
+struct PhaseTimer {
+    enum Phase phase;
+    uint64_t start;
+#if DISPLAYMODE_HAVE_SIGNPOST
+    os_signpost_id_t signpost;
+#endif
 };
 
+// Refresh rates closer than this are considered the same.
+static const double kRefreshTolerance = 0.005;
+
 // Returns non-zero if "actual" is acceptable for the given specification.
 static int MatchesRefreshRate(double specified, double actual) {
-    static const double kRefreshTolerance = 0.005;
     return specified == 0.0 || fabs(specified - actual) < kRefreshTolerance;
 }
 
-// Parses the "width height [display]" mode specification.
-static void ParseMode(const int argc, const char * argv[],
-                      struct ParsedArgs * parsed_args) {
-    if (argc <= kArgvHeightIndex) {
-        parsed_args->option = kOptionInvalidMode;
+// Returns the number of pixels per point of a mode.
+static double GetModeScale(uint32_t width, uint32_t pixel_width) {
+    return width ? (double) pixel_width / width : 0.0;
+}
+
+// Bytes per framebuffer pixel.  Every mode on current systems uses 32-bit
+// pixels (8-bit ARGB, or 10-bit channels packed into 32 bits), and the only
+// public way to query a mode's pixel encoding is deprecated.
+enum { kFramebufferBytesPerPixel = 4 };
+
+// Refresh rate assumed for the scanout bandwidth of modes that report 0 Hz,
+// such as those of built-in panels.
+static const double kNominalRefreshRate = 60.0;
+
+// Returns the size in bytes of a framebuffer with the given pixel size.
+static double GetFramebufferBytes(uint32_t pixel_width,
+                                  uint32_t pixel_height) {
+    return (double) pixel_width * pixel_height * kFramebufferBytesPerPixel;
+}
+
+// Returns the bytes per second needed to scan out a framebuffer with the
+// given pixel size at `refresh_rate'.
+static double GetScanoutBandwidth(uint32_t pixel_width, uint32_t pixel_height,
+                                  double refresh_rate) {
+    return GetFramebufferBytes(pixel_width, pixel_height) *
+        (refresh_rate == 0.0 ? kNominalRefreshRate : refresh_rate);
+}
+
+// Returns non-zero if a mode with "actual" pixels per point is acceptable for
+// the given specification.
+static int MatchesScale(double specified, double actual) {
+    static const double kScaleTolerance = 0.01;
+    return specified == 0.0 || fabs(specified - actual) < kScaleTolerance;
+}
+
+// Parses a "vendor-model-serial" display identity, with each number in hex.
+// Returns false if `s' is not an identity.
+static bool ParseDisplayIdentity(const char * s,
+                                 struct DisplayIdentity * identity) {
+    uint32_t * const fields[] = {
+        &identity->vendor, &identity->model, &identity->serial,
+    };
+    const size_t num_fields = sizeof(fields) / sizeof(fields[0]);
+    for (size_t i = 0; i < num_fields; ++i) {
+        char * end = NULL;
+        errno = 0;
+        const unsigned long value = strtoul(s, &end, 16);
+        const char separator = i + 1 < num_fields ? '-' : '\0';
+        if (end == s || *end != separator || errno != 0 ||
+            UINT32_MAX < value) {
+            errno = 0;
+            return false;
+        }
+        *fields[i] = (uint32_t) value;
+        s = end + 1;
+    }
+    return true;
+}
+
+// Parses a UUID in the canonical 8-4-4-4-12 hex form.  Returns false if `s'
+// is not a UUID.
+static bool ParseUUID(const char * s, CFUUIDBytes * uuid) {
+    static const char kPattern[] = "xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx";
+    if (strlen(s) != strlen(kPattern)) {
+        return false;
+    }
+    UInt8 bytes[sizeof(*uuid)] = { 0 };
+    size_t num_digits = 0;
+    for (size_t i = 0; kPattern[i]; ++i) {
+        if (kPattern[i] == '-') {
+            if (s[i] != '-') {
+                return false;
+            }
+            continue;
+        }
+        const char digits[] = { s[i], '\0' };
+        char * end = NULL;
+        const unsigned long digit = strtoul(digits, &end, 16);
+        if (*end != '\0' || end == digits) {
+            return false;
+        }
+        bytes[num_digits / 2] |= (UInt8) (digit << (num_digits % 2 ? 0 : 4));
+        ++num_digits;
+    }
+    memcpy(uuid, bytes, sizeof(*uuid));
+    return true;
+}
+
+// Parses a display given by its index, "id:" followed by its
+// CGDirectDisplayID, its UUID or its identity into `name' and, for an index,
+// `*index'.
+static void ParseDisplay(FILE * err, const char * arg,
+                         struct DisplayName * name, uint32_t * index,
+                         struct ParsedArgs * parsed_args) {
+    static const char kDisplayIDPrefix[] = "id:";
+    const size_t prefix_length = strlen(kDisplayIDPrefix);
+    if (0 == strncmp(arg, kDisplayIDPrefix, prefix_length)) {
+        const char * id = arg + prefix_length;
+        char * end = NULL;
+        errno = 0;
+        const unsigned long display_id = strtoul(id, &end, 10);
+        name->selector = kSelectDisplayID;
+        name->display_id = (CGDirectDisplayID) display_id;
+        if (end == id || *end != '\0' || errno != 0 ||
+            UINT32_MAX < display_id) {
+            fprintf(err, "Error parsing display ID \"%s\"\n", arg);
+            errno = 0;
+            parsed_args->option = kOptionInvalidMode;
+        }
+        return;
+    }
+    if (ParseUUID(arg, &name->uuid)) {
+        name->selector = kSelectDisplayUUID;
         return;
     }
+    if (strchr(arg, '-')) {
+        name->selector = kSelectDisplayIdentity;
+        if (!ParseDisplayIdentity(arg, &name->identity)) {
+            fprintf(err, "Error parsing display \"%s\"\n", arg);
+            parsed_args->option = kOptionInvalidMode;
+        }
+        return;
+    }
+    name->selector = kSelectDisplayIndex;
+    errno = 0;
+    *index = (uint32_t) strtoul(arg, NULL, 10);
+    if (errno != 0) {
+        fprintf(err, "Error parsing display \"%s\": %s\n", arg,
+                strerror(errno));
+        errno = 0;
+        parsed_args->option = kOptionInvalidMode;
+    }
+}
+
+// Parses the "<x>,<y>" after "at:" into `spec'.  Returns false if invalid.
+static bool ParseOrigin(const char * s, struct ModeSpec * spec) {
+    char * end = NULL;
+    errno = 0;
+    const long x = strtol(s, &end, 10);
+    if (end == s || *end != ',' || errno != 0 || x < INT32_MIN ||
+        INT32_MAX < x) {
+        errno = 0;
+        return false;
+    }
+    const char * y_string = end + 1;
+    const long y = strtol(y_string, &end, 10);
+    if (end == y_string || *end != '\0' || errno != 0 || y < INT32_MIN ||
+        INT32_MAX < y) {
+        errno = 0;
+        return false;
+    }
+    spec->set_origin = true;
+    spec->origin_x = (int32_t) x;
+    spec->origin_y = (int32_t) y;
+    return true;
+}
+
+// Parses the "[best] width height [@refresh] [x<scale>] [mirror:<display>]
+// [at:<x>,<y>]" mode starting at argv[index] into `spec'.  Returns the index
+// of the first word that isn't part of the mode.
+static int ParseModeWords(FILE * err, const int argc, const char * argv[],
+                          int index, struct ModeSpec * spec,
+                          struct ParsedArgs * parsed_args) {
+    spec->prefer = parsed_args->prefer;
+    if (index < argc && 0 == strcmp(argv[index], "best")) {
+        spec->best = true;
+        ++index;
+    }
+    const int width_index = index + kModeWidthOffset;
+    const int height_index = index + kModeHeightOffset;
+    if (argc <= height_index) {
+        parsed_args->option = kOptionInvalidMode;
+        return argc;
+    }
     errno = 0;
     const unsigned long width =
-        strtoul(argv[kArgvWidthIndex], NULL, 10);
+        strtoul(argv[width_index], NULL, 10);
     if (errno != 0) {
-        fprintf(stderr, "Error parsing width \"%s\": %s\n",
-                argv[kArgvWidthIndex], strerror(errno));
+        fprintf(err, "Error parsing width \"%s\": %s\n",
+                argv[width_index], strerror(errno));
         errno = 0;
         parsed_args->option = kOptionInvalidMode;
     }
 
     const unsigned long height =
-        strtoul(argv[kArgvHeightIndex], NULL, 10);
+        strtoul(argv[height_index], NULL, 10);
     if (errno != 0) {
-        fprintf(stderr, "Error parsing height \"%s\": %s\n",
-                argv[kArgvHeightIndex], strerror(errno));
+        fprintf(err, "Error parsing height \"%s\": %s\n",
+                argv[height_index], strerror(errno));
         errno = 0;
         parsed_args->option = kOptionInvalidMode;
     }
 
-    const size_t refresh_index = kArgvRefreshOrDisplayIndex;
-    size_t display_index = kArgvRefreshOrDisplayIndex;
-    if (refresh_index < argc && argv[kArgvRefreshOrDisplayIndex][0] == '@') {
-        ++display_index;
-        // Parse the optional refresh rate.
-        const char *s = argv[refresh_index] + 1;
+    // The optional refresh rate, scale, mirroring and origin may be given in
+    // any order.
+    static const char kMirrorPrefix[] = "mirror:";
+    static const char kOriginPrefix[] = "at:";
+    int display_index = index + kModeRefreshOrDisplayOffset;
+    for (; display_index < argc; ++display_index) {
+        const char * arg = argv[display_index];
+        const char *s = arg + 1;
         char *end = NULL;
-        parsed_args->refresh_rate = strtod(s, &end);
-        if (end == s) {
-            fprintf(stderr, "Error parsing refresh rate: \"%s\"\n",
-                argv[refresh_index]);
+        if (arg[0] == '@') {
+            // Parse the optional refresh rate, "max", "min" or range.
+            if (0 == strcmp(s, "max")) {
+                spec->refresh_pick = kRefreshPickHighest;
+                continue;
+            }
+            if (0 == strcmp(s, "min")) {
+                spec->refresh_pick = kRefreshPickLowest;
+                continue;
+            }
+            spec->refresh_rate = strtod(s, &end);
+            if (end != s && *end == '-') {
+                const char * max = end + 1;
+                spec->refresh_pick = kRefreshPickHighest;
+                spec->min_refresh_rate = spec->refresh_rate;
+                spec->max_refresh_rate = strtod(max, &end);
+                spec->refresh_rate = 0.0;
+                if (end == max || *end != '\0' ||
+                    spec->max_refresh_rate < spec->min_refresh_rate) {
+                    end = (char *) s;
+                }
+            }
+            if (end == s) {
+                fprintf(err, "Error parsing refresh rate: \"%s\"\n", arg);
+                parsed_args->option = kOptionInvalidMode;
+            }
+        } else if (arg[0] == 'x') {
+            // Parse the optional scale, e.g. "x2" for HiDPI modes.
+            spec->scale = strtod(s, &end);
+            if (end == s || *end != '\0' || spec->scale <= 0.0) {
+                fprintf(err, "Error parsing scale: \"%s\"\n", arg);
+                parsed_args->option = kOptionInvalidMode;
+            }
+        } else if (0 == strncmp(arg, kMirrorPrefix,
+                                strlen(kMirrorPrefix))) {
+            // Parse the display to mirror, or "none".
+            const char * mirror_of = arg + strlen(kMirrorPrefix);
+            if (0 == strcmp(mirror_of, "none")) {
+                spec->mirror = kMirrorNone;
+            } else {
+                spec->mirror = kMirrorDisplay;
+                ParseDisplay(err, mirror_of, &spec->mirror_of,
+                             &spec->mirror_index, parsed_args);
+            }
+        } else if (0 == strncmp(arg, kOriginPrefix, strlen(kOriginPrefix))) {
+            // Parse the optional origin, e.g. "at:-1920,0".
+            if (!ParseOrigin(arg + strlen(kOriginPrefix), spec)) {
+                fprintf(err, "Error parsing origin: \"%s\"\n", arg);
+                parsed_args->option = kOptionInvalidMode;
+            }
+        } else {
+            break;
+        }
+    }
+    if (spec->mirror == kMirrorDisplay && spec->set_origin) {
+        // Mirrors are placed at the origin of the display they mirror.
+        fputs("A display can't be both mirrored and moved\n", err);
+        parsed_args->option = kOptionInvalidMode;
+    }
+    if (0 < width && 0 < height) {
+        spec->width = width;
+        spec->height = height;
+    } else {
+        parsed_args->option = kOptionInvalidMode;
+    }
+    return display_index;
+}
+
+// Parses a mode as for ParseModeWords followed by an optional display.
+// Returns the index following the specification.
+static int ParseMode(FILE * err, const int argc, const char * argv[],
+                     int index, struct ModeSpec * spec,
+                     struct ParsedArgs * parsed_args) {
+    const int display_index =
+        ParseModeWords(err, argc, argv, index, spec, parsed_args);
+    if (argc <= display_index) {
+        return display_index;
+    }
+    ParseDisplay(err, argv[display_index], &spec->display,
+                 &spec->display_index, parsed_args);
+    return display_index + 1;
+}
+
+// Parses one or more consecutive mode specifications.  Every specification
+// except the last must include its display, e.g. "1920 1080 0 1280 720 1".
+static void ParseModes(FILE * err, const int argc, const char * argv[],
+                       struct ParsedArgs * parsed_args) {
+    const enum Option option = parsed_args->option;
+    int index = kArgvModeIndex;
+    do {
+        if (parsed_args->num_modes == kMaxDisplays) {
+            fprintf(err, "Too many modes; at most %u may be set\n",
+                    kMaxDisplays);
             parsed_args->option = kOptionInvalidMode;
+            return;
+        }
+        struct ModeSpec * spec = &parsed_args->modes[parsed_args->num_modes++];
+        index = ParseMode(err, argc, argv, index, spec, parsed_args);
+    } while (index < argc && parsed_args->option == option);
+
+    // Displays not given by index are checked once they have been found.
+    for (uint32_t i = 0; i < parsed_args->num_modes; ++i) {
+        for (uint32_t j = 0; j < i; ++j) {
+            if (parsed_args->modes[i].display.selector ==
+                    kSelectDisplayIndex &&
+                parsed_args->modes[j].display.selector ==
+                    kSelectDisplayIndex &&
+                parsed_args->modes[i].display_index ==
+                parsed_args->modes[j].display_index) {
+                fprintf(err, "Display %u specified more than once\n",
+                        parsed_args->modes[i].display_index);
+                parsed_args->option = kOptionInvalidMode;
+                return;
+            }
         }
     }
+}
 
-    if (display_index < argc) {
-        parsed_args->display_index =
-            (uint32_t) strtoul(argv[display_index], NULL, 10);
-        if (errno != 0) {
-            fprintf(stderr, "Error parsing display \"%s\": %s\n",
-                    argv[display_index], strerror(errno));
-            errno = 0;
+// Returns true if `flag' (which may be followed by "=value") is named `name'.
+static bool IsFlag(const char * flag, const char * name) {
+    const size_t length = strlen(name);
+    return 0 == strncmp(flag, name, length) &&
+           (flag[length] == '\0' || flag[length] == '=');
+}
+
+// Returns the value of a "--name=value" flag, or NULL if there is none.
+static const char * GetFlagValue(const char * flag) {
+    const char * equals = strchr(flag, '=');
+    return equals ? equals + 1 : NULL;
+}
+
+// Parses a single "--name[=value]" flag into `parsed_args'.  Returns false if
+// the flag is not recognised.
+static bool ParseFlag(const char * flag, struct ParsedArgs * parsed_args) {
+    const char * const value = GetFlagValue(flag);
+    if (IsFlag(flag, "--cache")) {
+        parsed_args->cache_dir = value ? value : "";
+        return true;
+    }
+    if (IsFlag(flag, "--fade") && value) {
+        char * end = NULL;
+        parsed_args->fade_out = strtod(value, &end);
+        parsed_args->fade_in = parsed_args->fade_out;
+        if (end != value && *end == ',') {
+            const char * fade_in = end + 1;
+            parsed_args->fade_in = strtod(fade_in, &end);
+            if (end == fade_in) {
+                return false;
+            }
+        }
+        parsed_args->fade = true;
+        return end != value && *end == '\0' &&
+               0 <= parsed_args->fade_out && 0 <= parsed_args->fade_in;
+    }
+    if (IsFlag(flag, "--scope") && value) {
+        if (0 == strcmp(value, "permanent")) {
+            parsed_args->scope = kScopePermanent;
+        } else if (0 == strcmp(value, "session")) {
+            parsed_args->scope = kScopeSession;
+        } else if (0 == strcmp(value, "app")) {
+            parsed_args->scope = kScopeApp;
+        } else {
+            return false;
+        }
+        return true;
+    }
+    if (IsFlag(flag, "--fallback") && value) {
+        parsed_args->fallback = value;
+        return *value != '\0';
+    }
+    if (0 == strcmp(flag, "--force")) {
+        parsed_args->force = true;
+        return true;
+    }
+    if (0 == strcmp(flag, "--dry-run")) {
+        parsed_args->dry_run = true;
+        return true;
+    }
+    if (IsFlag(flag, "--max-bandwidth") && value) {
+        char * end = NULL;
+        const double gigabytes = strtod(value, &end);
+        parsed_args->max_bandwidth = gigabytes * 1e9;
+        return end != value && *end == '\0' && 0 < gigabytes;
+    }
+    if (0 == strcmp(flag, "--hw-mirror")) {
+        parsed_args->hw_mirror = true;
+        return true;
+    }
+    if (0 == strcmp(flag, "--low-resolution")) {
+        parsed_args->low_resolution = true;
+        return true;
+    }
+    if (0 == strcmp(flag, "--timings")) {
+        parsed_args->timings = true;
+        return true;
+    }
+    if (IsFlag(flag, "--wait")) {
+        char * end = NULL;
+        parsed_args->wait_timeout =
+            value ? strtod(value, &end) : kSettleTimeout;
+        return !value || (end != value && *end == '\0' &&
+                          0 < parsed_args->wait_timeout);
+    }
+    if (IsFlag(flag, "--format") && value) {
+        if (0 == strcmp(value, "text")) {
+            parsed_args->format = kFormatText;
+        } else if (0 == strcmp(value, "json")) {
+            parsed_args->format = kFormatJSON;
+        } else if (0 == strcmp(value, "tsv")) {
+            parsed_args->format = kFormatTSV;
+        } else {
+            return false;
+        }
+        return true;
+    }
+    if (IsFlag(flag, "--prefer") && value) {
+        if (0 == strcmp(value, "resolution")) {
+            parsed_args->prefer = kPreferResolution;
+        } else if (0 == strcmp(value, "refresh")) {
+            parsed_args->prefer = kPreferRefresh;
+        } else if (0 == strcmp(value, "hidpi")) {
+            parsed_args->prefer = kPreferHiDPI;
+        } else {
+            return false;
+        }
+        return true;
+    }
+    if (IsFlag(flag, "--token-file") && value) {
+        parsed_args->token_path = value;
+        return true;
+    }
+    if (IsFlag(flag, "--concurrency") && value) {
+        char * end = NULL;
+        parsed_args->concurrency = strtoul(value, &end, 10);
+        return end != value && *end == '\0' && 0 < parsed_args->concurrency;
+    }
+    if (IsFlag(flag, "--iterations") && value) {
+        char * end = NULL;
+        parsed_args->iterations = strtoul(value, &end, 10);
+        return end != value && *end == '\0' && 0 < parsed_args->iterations;
+    }
+    return false;
+}
+
+// Parses and removes the "--" flags from argv, leaving only the positional
+// arguments.  A bare "--" ends the flags.  Returns the new argc, or -1 if a
+// flag was not recognised, in which case `parsed_args' describes the error.
+static int ParseFlags(int argc, const char * argv[],
+                      struct ParsedArgs * parsed_args) {
+    int positional_argc = 0;
+    int i = 0;
+    for (; i < argc; ++i) {
+        if (0 == strcmp(argv[i], "--")) {
+            break;
+        }
+        if (0 != strncmp(argv[i], "--", 2)) {
+            argv[positional_argc++] = argv[i];
+        } else if (!ParseFlag(argv[i], parsed_args)) {
+            parsed_args->option = kOptionInvalid;
+            parsed_args->literal_option = argv[i];
+            return -1;
+        }
+    }
+    for (; i < argc; ++i) {
+        argv[positional_argc++] = argv[i];
+    }
+    return positional_argc;
+}
+
+// Parses the comma-separated "<width>x<height>[@<refresh>]" modes given to
+// --fallback.  Each is for the same display as the requested mode, and is
+// matched the same way apart from its size and refresh rate.
+static void ParseFallbacks(FILE * err, struct ParsedArgs * parsed_args) {
+    if (parsed_args->option != kOptionConfigureMode ||
+        parsed_args->num_modes != 1) {
+        fputs("--fallback needs \"t\" with a single mode\n", err);
+        parsed_args->option = kOptionInvalidMode;
+        return;
+    }
+    char list[kMaxCommandLength];
+    snprintf(list, sizeof(list), "%s", parsed_args->fallback);
+    char * saveptr = NULL;
+    for (char * word = strtok_r(list, ",", &saveptr); word != NULL;
+         word = strtok_r(NULL, ",", &saveptr)) {
+        if (parsed_args->num_fallbacks == kMaxFallbacks) {
+            fprintf(err, "Too many fallback modes; at most %u may be given\n",
+                    kMaxFallbacks);
             parsed_args->option = kOptionInvalidMode;
+            return;
+        }
+        // Split "<width>x<height>[@<refresh>]" into ParseMode's words.
+        char refresh[kMaxCommandLength] = "";
+        char * at = strchr(word, '@');
+        if (at) {
+            snprintf(refresh, sizeof(refresh), "%s", at);
+            *at = '\0';
+        }
+        char * x = strchr(word, 'x');
+        // ParseModeWords allows a suffix after the numbers, so check that
+        // nothing follows them, e.g. a scale in "1920x1080@60x2".
+        static const char kDigits[] = "0123456789";
+        static const char kRateChars[] = "0123456789.-";
+        const char * const rate = refresh + (at ? 1 : 0);
+        if (NULL == x || strspn(word, kDigits) != (size_t) (x - word) ||
+            x[1 + strspn(x + 1, kDigits)] != '\0' ||
+            (rate[strspn(rate, kRateChars)] != '\0' &&
+             0 != strcmp(rate, "max") && 0 != strcmp(rate, "min"))) {
+            fprintf(err, "Error parsing fallback mode: \"%s%s\"\n", word,
+                    refresh);
+            parsed_args->option = kOptionInvalidMode;
+            return;
+        }
+        *x = '\0';
+        const char * argv[] = { word, x + 1, refresh };
+        const int argc = at ? 3 : 2;
+
+        struct ModeSpec * const spec =
+            &parsed_args->fallbacks[parsed_args->num_fallbacks++];
+        *spec = parsed_args->modes[0];
+        spec->refresh_rate = 0.0;
+        spec->refresh_pick = kRefreshPickExact;
+        spec->min_refresh_rate = 0.0;
+        spec->max_refresh_rate = 0.0;
+        spec->scale = 0.0;
+        if (argc != ParseModeWords(err, argc, argv, 0, spec, parsed_args)) {
+            fprintf(err, "Error parsing fallback mode: \"%s\"\n",
+                    parsed_args->fallback);
+            parsed_args->option = kOptionInvalidMode;
+        }
+        if (parsed_args->option != kOptionConfigureMode) {
+            return;
         }
     }
-    if (0 < width && 0 < height) {
-        parsed_args->width = width;
-        parsed_args->height = height;
-    } else {
+}
+
+// Parses the displays that "c" and "d" are limited to.
+static void ParseDisplays(FILE * err, const int argc, const char * argv[],
+                          struct ParsedArgs * parsed_args) {
+    for (int i = kArgvDisplayIndex; i < argc; ++i) {
+        if (parsed_args->num_displays == kMaxDisplays) {
+            fprintf(err, "Too many displays; at most %u may be given\n",
+                    kMaxDisplays);
+            parsed_args->option = kOptionInvalidMode;
+            return;
+        }
+        const uint32_t n = parsed_args->num_displays++;
+        ParseDisplay(err, argv[i], &parsed_args->displays[n],
+                     &parsed_args->display_indexes[n], parsed_args);
+    }
+}
+
+// Parses the modes followed by "--" and the command to run with them.
+static void ParseCommand(FILE * err, const int argc, const char * argv[],
+                         struct ParsedArgs * parsed_args) {
+    int separator = kArgvModeIndex;
+    while (separator < argc && 0 != strcmp(argv[separator], "--")) {
+        ++separator;
+    }
+    if (argc <= separator + 1) {
+        fputs("Missing \"--\" and command to run\n", err);
         parsed_args->option = kOptionInvalidMode;
+        return;
     }
+    parsed_args->command = &argv[separator + 1];
+    parsed_args->command_argc = argc - separator - 1;
+    ParseModes(err, separator, argv, parsed_args);
 }
 
-// Parses the command-line arguments and returns them.
-static struct ParsedArgs ParseArgs(int argc, const char * argv[]) {
+// Parses the command-line arguments and returns them.  Parse errors are
+// reported to `err'.  Flags are removed from argv.
+static struct ParsedArgs ParseArgs(FILE * err, int argc, const char * argv[]) {
     struct ParsedArgs parsed_args = { 0 };
 
+    if ((argc = ParseFlags(argc, argv, &parsed_args)) < 0) {
+        return parsed_args;
+    }
     if (argc <= 1) {
         return parsed_args;
     }
@@ -148,237 +964,4108 @@ static struct ParsedArgs ParseArgs(int argc, const char * argv[]) {
     // All options are single-letter.
     const char option = argv[kArgvOptionIndex][0];
     switch (option) {
+        case kOptionPipeline:
+        case kOptionBenchmark:
+        case kOptionCurrentMode:
         case kOptionSupportedModes:
+        case kOptionCapture:
+        case kOptionFleet:
         case kOptionHelp:
+        case kOptionProfile:
+        case kOptionRun:
+        case kOptionServer:
         case kOptionConfigureMode:
         case kOptionVersion:
+        case kOptionWatch:
             parsed_args.option = option;
             break;
     }
 
     if (option == kOptionConfigureMode) {
-        ParseMode(argc, argv, &parsed_args);
+        ParseModes(err, argc, argv, &parsed_args);
+        if (parsed_args.fallback &&
+            parsed_args.option == kOptionConfigureMode) {
+            ParseFallbacks(err, &parsed_args);
+        }
+    } else if (option == kOptionCurrentMode ||
+               option == kOptionSupportedModes) {
+        ParseDisplays(err, argc, argv, &parsed_args);
+    } else if (option == kOptionCapture || option == kOptionRun) {
+        ParseCommand(err, argc, argv, &parsed_args);
+    } else if (option == kOptionBenchmark && kArgvModeIndex < argc) {
+        ParseModes(err, argc, argv, &parsed_args);
+        if (1 < parsed_args.num_modes) {
+            fputs("Only one mode may be benchmarked\n", err);
+            parsed_args.option = kOptionInvalidMode;
+        }
+    } else if (option == kOptionProfile) {
+        if (argc <= kArgvProfileIndex) {
+            parsed_args.option = kOptionInvalid;
+        } else if (0 == strcmp(argv[kArgvProfileIndex], "save")) {
+            if (argc <= kArgvSavedProfileIndex) {
+                parsed_args.option = kOptionInvalid;
+            } else {
+                parsed_args.save_profile = true;
+                parsed_args.profile_path = argv[kArgvSavedProfileIndex];
+            }
+        } else {
+            parsed_args.profile_path = argv[kArgvProfileIndex];
+        }
+    } else if (option == kOptionFleet) {
+        // A "--" lets flags such as --wait be sent with the command.
+        int command_index = kArgvFleetCommandIndex;
+        if (command_index < argc && 0 == strcmp(argv[command_index], "--")) {
+            ++command_index;
+        }
+        if (argc <= command_index) {
+            parsed_args.option = kOptionInvalid;
+        } else {
+            parsed_args.hosts_path = argv[kArgvHostsIndex];
+            parsed_args.command = &argv[command_index];
+            parsed_args.command_argc = argc - command_index;
+        }
+    } else if (option == kOptionServer) {
+        if (argc <= kArgvSocketIndex) {
+            parsed_args.option = kOptionInvalid;
+        } else {
+            parsed_args.socket_path = argv[kArgvSocketIndex];
+        }
     }
     return parsed_args;
 }
 
+// Splits `line' in place into whitespace-separated words, storing them in
+// `argv' after a placeholder program name so that the result can be passed to
+// ParseArgs.  Returns the resulting argc, or -1 if there are more than
+// `max_args' words (including the placeholder), rather than truncating the
+// command.
+static int SplitCommandLine(char * line, const char * argv[], int max_args) {
+    static const char kSeparators[] = " \t\r\n";
+    int argc = 0;
+    argv[argc++] = "displaymode";
+    char * saveptr = NULL;
+    for (char * word = strtok_r(line, kSeparators, &saveptr); word != NULL;
+         word = strtok_r(NULL, kSeparators, &saveptr)) {
+        if (argc == max_args) {
+            return -1;
+        }
+        argv[argc++] = word;
+    }
+    return argc;
+}
+
 static const char kUsage[] =
     "Usage:\n\n"
     "  displaymode [options...]\n\n"
     "Options:\n"
-    "  t <width> <height> [@<refresh>] [display]\n"
-    "      sets the display's width, height and (optionally) refresh rate\n\n"
-    "  d\n"
-    "      prints available resolutions for each display\n\n"
+    "  t [best] <width> <height> [@<refresh>] [x<scale>]\n"
+    "    [mirror:<display>|mirror:none] [at:<x>,<y>] [display]\n"
+    "    [<width> ...]\n"
+    "      sets the display's width, height and (optionally) refresh rate;\n"
+    "      several displays may be set at once by giving a mode for each.\n"
+    "      The refresh rate may also be @max, @min or a range such as\n"
+    "      @100-144, which picks the highest rate in the range.\n"
+    "      Add x<scale> (e.g. x2) to choose between modes with the same size\n"
+    "      in points but different pixel backings.\n"
+    "      Add mirror:<display> to mirror another display (or mirror:none to\n"
+    "      stop mirroring), and at:<x>,<y> to move the display; these are\n"
+    "      set in the same reconfiguration as the modes.\n"
+    "      The display may be its index (0 by default), \"id:\" and its\n"
+    "      display ID, its UUID, or its vendor-model-serial numbers in hex.\n"
+    "      With \"best\", picks the closest available mode instead of\n"
+    "      requiring an exact match\n\n"
+    "  d [display...]\n"
+    "      prints available resolutions for each display, or only for the\n"
+    "      given displays\n\n"
+    "  c [display...]\n"
+    "      prints the current mode of each display, or of the given\n"
+    "      displays, without listing their other modes\n\n"
+    "  r <width> <height> [...] -- <command> [args...]\n"
+    "      sets the modes as for \"t\" and runs the command, then restores\n"
+    "      the original modes when it exits\n\n"
+    "  k <width> <height> [...] -- <command> [args...]\n"
+    "      captures the displays, sets their modes as for \"t\" and runs\n"
+    "      the command, then releases the displays and restores their\n"
+    "      modes when it exits\n\n"
+    "  p <profile>\n"
+    "      sets the modes listed in a profile file, all at once\n\n"
+    "  p save <profile>\n"
+    "      saves the current mode of every display to a profile file\n\n"
+    "  b [<width> <height> [@<refresh>] [display]]\n"
+    "      benchmarks display queries and, if a mode is given, switching\n"
+    "      to and from it; prints percentiles as JSON lines\n\n"
+    "  w\n"
+    "      watches for displays being added, removed, mirrored or changing\n"
+    "      mode, printing each change as it happens\n\n"
+    "  s <socket>\n"
+    "      serves \"t\", \"c\" and \"d\" commands sent one per line to a Unix\n"
+    "      domain socket, keeping display modes cached between commands\n\n"
+    "  s tcp:[<address>:]<port> --token-file=<file>\n"
+    "      serves commands over TCP to clients that know the shared secret\n"
+    "      in the token file\n\n"
+    "  f --token-file=<file> <hosts> [--] <command> [\\; <command>...]\n"
+    "      sends the commands to the \"s tcp:\" server on each host listed\n"
+    "      in the hosts file, printing each host's output.  Flags after\n"
+    "      \"--\" are sent with the commands\n\n"
+    "  -\n"
+    "      reads commands from standard input, one per line, and runs them\n"
+    "      in turn, printing \"ok\" or \"error <status>\" after each.\n"
+    "      Consecutive \"t\" commands for different displays that are read\n"
+    "      together are set in one reconfiguration\n\n"
     "  h\n"
     "      prints this message\n\n"
     "  v\n"
-    "      prints version and copyright notice\n";
+    "      prints version and copyright notice\n\n"
+    "Flags:\n"
+    "  --cache[=<dir>]\n"
+    "      lists modes for \"d\" from an on-disk cache, which is refreshed\n"
+    "      whenever the set of displays changes\n\n"
+    "  --low-resolution\n"
+    "      includes duplicate modes with low-resolution backing stores, for\n"
+    "      listing and selecting\n\n"
+    "  --fade=<seconds>[,<seconds>]\n"
+    "      fades out and in for the given times when reconfiguring, instead\n"
+    "      of the default fade; --fade=0 switches without fading\n\n"
+    "  --scope=permanent|session|app\n"
+    "      sets whether changes are saved in preferences (the default), last\n"
+    "      until logout, or last until displaymode exits; for \"s\", sets the\n"
+    "      default for commands sent to the server\n\n"
+    "  --dry-run\n"
+    "      makes \"t\", \"r\", \"k\" and \"p\" print the mode each display\n"
+    "      would be set to, and whether it would change, without\n"
+    "      reconfiguring anything or running the command\n\n"
+    "  --fallback=<width>x<height>[@<refresh>][,...]\n"
+    "      makes \"t\" try each of these modes in turn, for the same\n"
+    "      display, if the requested mode can't be found or is rejected\n\n"
+    "  --force\n"
+    "      makes \"t\" reconfigure displays already in the requested mode\n\n"
+    "  --hw-mirror\n"
+    "      sets displays given mirror:<display> to a mode with the same size\n"
+    "      in points and pixels as the display they mirror, if they have\n"
+    "      one, so that they can be mirrored in hardware\n\n"
+    "  --timings\n"
+    "      reports how long each phase of the command took, including the\n"
+    "      time for reconfigured displays to settle\n\n"
+    "  --wait[=<seconds>]\n"
+    "      makes \"t\" wait (by default up to 10 seconds) until the displays\n"
+    "      have finished reconfiguring, failing if they don't\n\n"
+    "  --max-bandwidth=<GB/s>\n"
+    "      limits the total scanout bandwidth of all displays; modes are\n"
+    "      chosen for the displays in order, each within what is left\n\n"
+    "  --format=text|json|tsv\n"
+    "      makes \"d\" print one JSON object or tab-separated row per mode,\n"
+    "      and \"w\" one JSON object or row per change\n\n"
+    "  --prefer=resolution|refresh|hidpi\n"
+    "      sets what \"t best\" favours among modes of the closest\n"
+    "      resolution: its aspect ratio (the default), the refresh rate,\n"
+    "      or HiDPI\n\n"
+    "  --concurrency=<n>\n"
+    "      sets how many hosts \"f\" talks to at once (default 32)\n\n"
+    "  --iterations=<n>\n"
+    "      sets how many times \"b\" repeats each benchmark\n";
 
 // Prints a message describing how to invoke the tool on the command line.
-static void ShowUsage(void) {
-    puts(kUsage);
-}
-
-// Prints the resolution and refresh rate for a display mode.
-static void PrintMode(CGDisplayModeRef mode) {
-    const size_t width = CGDisplayModeGetWidth(mode);
-    const size_t height = CGDisplayModeGetHeight(mode);
-    const double refresh_rate = CGDisplayModeGetRefreshRate(mode);
-    const bool usable_for_desktop =
-        CGDisplayModeIsUsableForDesktopGUI(mode);
-    printf("%zu x %zu @%.1fHz%s", width, height, refresh_rate,
-           usable_for_desktop ? "" : " !");
-}
-
-// Prints all display modes for the main display.  Returns 0 on success.
-static int PrintModes(CGDirectDisplayID display) {
-    CGDisplayModeRef current_mode = CGDisplayCopyDisplayMode(display);
-
-    CFArrayRef modes = CGDisplayCopyAllDisplayModes(display, NULL);
-    const CFIndex count = CFArrayGetCount(modes);
-
-    Boolean has_current = 0;
-    for (CFIndex i = 0; i < count; ++i) {
-        CGDisplayModeRef mode =
-            (CGDisplayModeRef) CFArrayGetValueAtIndex(modes, i);
-        PrintMode(mode);
-        if (CFEqual(mode, current_mode)) {
-            has_current = 1;
-            puts(" *");
-        } else {
-            puts("");
-        }
-    }
-    if (!has_current) {
-        PrintMode(current_mode);
-        puts(" *");
-    }
-    CFRelease(modes);
-    CGDisplayModeRelease(current_mode);
-    return EXIT_SUCCESS;
+static void ShowUsage(FILE * out) {
+    fprintf(out, "%s\n", kUsage);
 }
 
-static int PrintModesForAllDisplays(void) {
-    CGDirectDisplayID displays[kMaxDisplays];
-    uint32_t num_displays;
-    CGError e =
-        CGGetActiveDisplayList(kMaxDisplays, &displays[0], &num_displays);
-    if (e) {
-        fprintf(stderr, "CGGetActiveDisplayList CGError: %d\n", e);
-        return e;
-    }
+// Returns the time in nanoseconds according to a monotonic clock.
+static uint64_t GetMonotonicNanoseconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
 
-    for (uint32_t i = 0; i < num_displays; ++i) {
-        printf("%sDisplay %u%s:\n", i == 0 ? "" : "\n", i, i == 0 ? " (MAIN)" : "");
-        PrintModes(displays[i]);
-    }
+#if DISPLAYMODE_HAVE_SIGNPOST
+static os_log_t signpost_log;
 
-    return EXIT_SUCCESS;
+static void CreateSignpostLog(void * context) {
+    signpost_log = os_log_create("displaymode", "PointsOfInterest");
 }
 
-// Returns the display ID (arbitrary integers) corresponding to the given
-// display index (0-indexed).
-static CGError GetDisplayID(uint32_t display_index,
-                            CGDirectDisplayID * display) {
-    CGDirectDisplayID displays[kMaxDisplays];
-    uint32_t num_displays;
-    CGError e =
-        CGGetActiveDisplayList(kMaxDisplays, &displays[0], &num_displays);
-    if (e) {
-        fprintf(stderr, "CGGetActiveDisplayList CGError: %d\n", e);
-        return e;
-    }
-    if (num_displays <= display_index) {
-        fprintf(stderr, "Display %u not supported; display must be < %u\n",
-                display_index, num_displays);
-        return kCGErrorRangeCheck;
-    }
-    *display = displays[display_index];
-    return kCGErrorSuccess;
+// Returns the log for signposts.  Safe to call from any thread.
+static os_log_t GetSignpostLog(void) {
+    static dispatch_once_t once;
+    dispatch_once_f(&once, NULL, CreateSignpostLog);
+    return signpost_log;
 }
+#endif
 
-// Returns the first mode whose resolution matches the width and height
-// specified in `parsed_args'.  Returns NULL if no modes matched.
-// The caller owns the returned mode.
-static CGDisplayModeRef GetModeMatching(const struct ParsedArgs * parsed_args,
-                                        const CGDirectDisplayID display) {
-    CFArrayRef modes = CGDisplayCopyAllDisplayModes(display, NULL);
-    const CFIndex count = CFArrayGetCount(modes);
-
-    CGDisplayModeRef matched_mode = NULL;
-    // Set matched_mode to the first display mode matching the requested
-    // resolution.
-    for (CFIndex i = 0; i < count; ++i) {
-        CGDisplayModeRef const mode =
-            (CGDisplayModeRef) CFArrayGetValueAtIndex(modes, i);
-        const size_t width = CGDisplayModeGetWidth(mode);
-        const size_t height = CGDisplayModeGetHeight(mode);
-        const double refresh_rate = CGDisplayModeGetRefreshRate(mode);
-        if (width == parsed_args->width &&
-            height == parsed_args->height &&
-            MatchesRefreshRate(parsed_args->refresh_rate, refresh_rate)) {
-            matched_mode = CGDisplayModeRetain(mode);
-            break;
-        }
-    }
-    CFRelease(modes);
-    return matched_mode;
+// Starts timing a phase.
+static struct PhaseTimer BeginPhase(enum Phase phase) {
+    struct PhaseTimer timer = { .phase = phase };
+#if DISPLAYMODE_HAVE_SIGNPOST
+    os_log_t log = GetSignpostLog();
+    timer.signpost = os_signpost_id_generate(log);
+    os_signpost_interval_begin(log, timer.signpost, "Phase", "%{public}s",
+                               kPhaseNames[phase]);
+#endif
+    timer.start = GetMonotonicNanoseconds();
+    return timer;
 }
 
-// Changes the resolution permanently for the user.
-static int ConfigureMode(const struct ParsedArgs * parsed_args) {
-    CGDirectDisplayID display;
-    CGError e;
-    if ((e = GetDisplayID(parsed_args->display_index, &display))) {
-        return e;
+// Stops timing a phase, adding its duration to the session's timings.
+static void EndPhase(const struct Session * session,
+                     const struct PhaseTimer * timer) {
+    const uint64_t end = GetMonotonicNanoseconds();
+#if DISPLAYMODE_HAVE_SIGNPOST
+    os_signpost_interval_end(GetSignpostLog(), timer->signpost, "Phase",
+                             "%{public}s", kPhaseNames[timer->phase]);
+#endif
+    if (session->timings) {
+        session->timings->nanoseconds[timer->phase] += end - timer->start;
+        ++session->timings->counts[timer->phase];
     }
+}
 
-    CGDisplayModeRef mode = GetModeMatching(parsed_args, display);
-    if (NULL == mode) {
-        if (parsed_args->refresh_rate == 0.0) {
-            fprintf(stderr, "Could not find a mode for resolution %lux%lu\n",
-                    parsed_args->width, parsed_args->height);
-        } else {
-            fprintf(stderr, "Could not find a mode for resolution %lux%lu"
-                    " @%.1f\n",
-                    parsed_args->width, parsed_args->height,
-                    parsed_args->refresh_rate);
+// Prints the duration of each phase that occurred.
+static void PrintTimings(FILE * out, const struct Timings * timings) {
+    for (int i = 0; i < kNumPhases; ++i) {
+        if (timings->counts[i]) {
+            fprintf(out, "timing %s %.3f ms\n", kPhaseNames[i],
+                    (double) timings->nanoseconds[i] / 1e6);
         }
-        return -1;
     }
+}
 
-    // Save the original resolution.
-    CGDisplayModeRef original_mode = CGDisplayCopyDisplayMode(display);
-    const size_t original_width = CGDisplayModeGetWidth(original_mode);
-    const size_t original_height = CGDisplayModeGetHeight(original_mode);
-    const double original_refresh_rate =
-        CGDisplayModeGetRefreshRate(original_mode);
-    CGDisplayModeRelease(original_mode);
-
-    // Change the resolution.
-    CGDisplayConfigRef config;
-    if ((e = CGBeginDisplayConfiguration(&config))) {
-        fprintf(stderr, "CGBeginDisplayConfiguration CGError: %d\n", e);
-        return e;
+// Fetches the active display list into the session's state if it is not
+// already cached.
+static CGError GetActiveDisplays(const struct Session * session) {
+    struct DisplayState * const state = session->state;
+    if (state->has_displays) {
+        return kCGErrorSuccess;
     }
-    if ((e = CGConfigureDisplayWithDisplayMode(config, display, mode, NULL))) {
-        fprintf(stderr, "CGConfigureDisplayWithDisplayMode CGError: %d\n", e);
+    const struct PhaseTimer timer = BeginPhase(kPhaseDisplayList);
+    CGError e = CGGetActiveDisplayList(kMaxDisplays, &state->displays[0],
+                                       &state->num_displays);
+    EndPhase(session, &timer);
+    if (e) {
+        fprintf(session->err, "CGGetActiveDisplayList CGError: %d\n", e);
         return e;
     }
-    if ((e = CGCompleteDisplayConfiguration(config, kCGConfigurePermanently))) {
-        fprintf(stderr, "CGCompleteDisplayConfiguration CGError: %d\n", e);
-        return e;
+    state->has_displays = true;
+    return kCGErrorSuccess;
+}
+
+// Returns all modes for the display at the given index, copying them on first
+// use.  The state retains ownership of the returned array.
+static CFArrayRef GetDisplayModes(const struct Session * session,
+                                  uint32_t display_index) {
+    struct DisplayState * const state = session->state;
+    if (NULL == state->modes[display_index]) {
+        const struct PhaseTimer timer = BeginPhase(kPhaseEnumeration);
+        state->modes[display_index] = CGDisplayCopyAllDisplayModes(
+            state->displays[display_index], session->mode_options);
+        EndPhase(session, &timer);
     }
-    CGDisplayModeRelease(mode);
+    return state->modes[display_index];
+}
 
-    if (parsed_args->refresh_rate == 0.0) {
-        printf("Changed display resolution from %zux%zu to %lux%lu\n",
-               original_width, original_height,
-               parsed_args->width, parsed_args->height);
-    } else {
-        printf("Changed display resolution from %zux%zu @%f to %lux%lu @%.1f\n",
-               original_width, original_height, original_refresh_rate,
-               parsed_args->width, parsed_args->height,
-               parsed_args->refresh_rate);
+// Returns the current mode of the display at the given index, copying it on
+// first use.  The state retains ownership of the returned mode.
+static CGDisplayModeRef GetCurrentMode(const struct Session * session,
+                                       uint32_t display_index) {
+    struct DisplayState * const state = session->state;
+    if (NULL == state->current_modes[display_index]) {
+        state->current_modes[display_index] =
+            CGDisplayCopyDisplayMode(state->displays[display_index]);
     }
-    return EXIT_SUCCESS;
+    return state->current_modes[display_index];
 }
 
-int main(int argc, const char * argv[]) {
-    const struct ParsedArgs parsed_args = ParseArgs(argc, argv);
-    switch (parsed_args.option) {
+static void CreateLowResolutionModeOptions(void * context) {
+    const void * keys[] = { kCGDisplayShowDuplicateLowResolutionModes };
+    const void * values[] = { kCFBooleanTrue };
+    *(CFDictionaryRef *) context = CFDictionaryCreate(
+        kCFAllocatorDefault, keys, values, 1, &kCFTypeDictionaryKeyCallBacks,
+        &kCFTypeDictionaryValueCallBacks);
+}
+
+// Returns the CGDisplayCopyAllDisplayModes options that include duplicate
+// low-resolution modes.  The dictionary is created once and never released.
+static CFDictionaryRef GetLowResolutionModeOptions(void) {
+    static dispatch_once_t once;
+    static CFDictionaryRef options;
+    dispatch_once_f(&once, &options, CreateLowResolutionModeOptions);
+    return options;
+}
+
+// Gets the listed properties of `mode'.
+static void GetModeInfo(CGDisplayModeRef mode, struct ModeInfo * info) {
+    info->width = (uint32_t) CGDisplayModeGetWidth(mode);
+    info->height = (uint32_t) CGDisplayModeGetHeight(mode);
+    info->pixel_width = (uint32_t) CGDisplayModeGetPixelWidth(mode);
+    info->pixel_height = (uint32_t) CGDisplayModeGetPixelHeight(mode);
+    info->refresh_rate = CGDisplayModeGetRefreshRate(mode);
+    info->io_mode_id = CGDisplayModeGetIODisplayModeID(mode);
+    info->io_flags = CGDisplayModeGetIOFlags(mode);
+    info->usable_for_desktop = CGDisplayModeIsUsableForDesktopGUI(mode);
+}
+
+// Returns true if `a' and `b' describe the same display mode.
+static bool IsSameModeInfo(const struct ModeInfo * a,
+                           const struct ModeInfo * b) {
+    return a->width == b->width && a->height == b->height &&
+           a->pixel_width == b->pixel_width &&
+           a->pixel_height == b->pixel_height &&
+           a->refresh_rate == b->refresh_rate &&
+           a->io_mode_id == b->io_mode_id && a->io_flags == b->io_flags;
+}
+
+static void FreeModeTable(struct ModeTable * table) {
+    if (NULL == table) {
+        return;
+    }
+    free(table->widths);
+    free(table->heights);
+    free(table->pixel_widths);
+    free(table->pixel_heights);
+    free(table->refresh_rates);
+    free(table->io_mode_ids);
+    free(table->io_flags);
+    free(table->usable_for_desktop);
+    free(table->by_resolution);
+    free(table);
+}
+
+// Allocates a table with `count' uninitialized rows.  Returns NULL on
+// failure.
+static struct ModeTable * AllocateModeTable(size_t count) {
+    struct ModeTable * table = calloc(1, sizeof(*table));
+    if (NULL == table) {
+        return NULL;
+    }
+    // Avoid zero-sized allocations, which may return NULL.
+    const size_t n = count ? count : 1;
+    table->count = count;
+    table->widths = calloc(n, sizeof(*table->widths));
+    table->heights = calloc(n, sizeof(*table->heights));
+    table->pixel_widths = calloc(n, sizeof(*table->pixel_widths));
+    table->pixel_heights = calloc(n, sizeof(*table->pixel_heights));
+    table->refresh_rates = calloc(n, sizeof(*table->refresh_rates));
+    table->io_mode_ids = calloc(n, sizeof(*table->io_mode_ids));
+    table->io_flags = calloc(n, sizeof(*table->io_flags));
+    table->usable_for_desktop = calloc(n, sizeof(*table->usable_for_desktop));
+    table->by_resolution = calloc(n, sizeof(*table->by_resolution));
+    if (!table->widths || !table->heights || !table->pixel_widths ||
+        !table->pixel_heights || !table->refresh_rates ||
+        !table->io_mode_ids || !table->io_flags ||
+        !table->usable_for_desktop || !table->by_resolution) {
+        FreeModeTable(table);
+        return NULL;
+    }
+    return table;
+}
+
+static void SetModeTableRow(struct ModeTable * table, size_t row,
+                            const struct ModeInfo * info) {
+    table->widths[row] = info->width;
+    table->heights[row] = info->height;
+    table->pixel_widths[row] = info->pixel_width;
+    table->pixel_heights[row] = info->pixel_height;
+    table->refresh_rates[row] = info->refresh_rate;
+    table->io_mode_ids[row] = info->io_mode_id;
+    table->io_flags[row] = info->io_flags;
+    table->usable_for_desktop[row] = (uint8_t) info->usable_for_desktop;
+}
+
+static void GetModeTableRow(const struct ModeTable * table, size_t row,
+                            struct ModeInfo * info) {
+    info->width = table->widths[row];
+    info->height = table->heights[row];
+    info->pixel_width = table->pixel_widths[row];
+    info->pixel_height = table->pixel_heights[row];
+    info->refresh_rate = table->refresh_rates[row];
+    info->io_mode_id = table->io_mode_ids[row];
+    info->io_flags = table->io_flags[row];
+    info->usable_for_desktop = table->usable_for_desktop[row];
+}
+
+// Sort key for ordering the rows of a ModeTable by resolution.
+struct ResolutionKey {
+    uint32_t width;
+    uint32_t height;
+    uint32_t row;
+};
+
+static int CompareResolutionKeys(const void * a, const void * b) {
+    const struct ResolutionKey * x = a;
+    const struct ResolutionKey * y = b;
+    if (x->width != y->width) {
+        return x->width < y->width ? -1 : 1;
+    }
+    if (x->height != y->height) {
+        return x->height < y->height ? -1 : 1;
+    }
+    return x->row < y->row ? -1 : x->row > y->row;
+}
+
+// Fills in `by_resolution' from the table's rows.  Returns false on failure.
+static bool IndexModeTable(struct ModeTable * table) {
+    struct ResolutionKey * keys =
+        calloc(table->count ? table->count : 1, sizeof(*keys));
+    if (NULL == keys) {
+        return false;
+    }
+    for (size_t i = 0; i < table->count; ++i) {
+        keys[i].width = table->widths[i];
+        keys[i].height = table->heights[i];
+        keys[i].row = (uint32_t) i;
+    }
+    qsort(keys, table->count, sizeof(*keys), CompareResolutionKeys);
+    for (size_t i = 0; i < table->count; ++i) {
+        table->by_resolution[i] = keys[i].row;
+    }
+    free(keys);
+    return true;
+}
+
+// Copies the properties of every mode in `modes' into a new table.  Returns
+// NULL on failure.  The caller owns the returned table.
+static struct ModeTable * CreateModeTable(CFArrayRef modes) {
+    const size_t count = (size_t) CFArrayGetCount(modes);
+    struct ModeTable * table = AllocateModeTable(count);
+    if (NULL == table) {
+        return NULL;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        struct ModeInfo info;
+        GetModeInfo(
+            (CGDisplayModeRef) CFArrayGetValueAtIndex(modes, (CFIndex) i),
+            &info);
+        SetModeTableRow(table, i, &info);
+    }
+    if (!IndexModeTable(table)) {
+        FreeModeTable(table);
+        return NULL;
+    }
+    return table;
+}
+
+// Returns the first position in `by_resolution' whose row has a resolution
+// no less than width x height.
+static size_t FindResolution(const struct ModeTable * table,
+                             uint32_t width, uint32_t height) {
+    size_t low = 0;
+    size_t high = table->count;
+    while (low < high) {
+        const size_t middle = low + (high - low) / 2;
+        const uint32_t row = table->by_resolution[middle];
+        if (table->widths[row] < width ||
+            (table->widths[row] == width && table->heights[row] < height)) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// Releases the cached current modes, so that they will be copied again when
+// next needed.
+static void InvalidateCurrentModes(struct DisplayState * state) {
+    for (uint32_t i = 0; i < kMaxDisplays; ++i) {
+        CGDisplayModeRelease(state->current_modes[i]);
+        state->current_modes[i] = NULL;
+    }
+}
+
+// Releases the cached display and mode lists, so that they will be
+// re-fetched when next needed.
+static void InvalidateDisplayState(struct DisplayState * state) {
+    InvalidateCurrentModes(state);
+    for (uint32_t i = 0; i < kMaxDisplays; ++i) {
+        if (state->modes[i]) {
+            CFRelease(state->modes[i]);
+            state->modes[i] = NULL;
+        }
+        FreeModeTable(state->mode_tables[i]);
+        state->mode_tables[i] = NULL;
+    }
+    state->has_displays = false;
+    state->num_displays = 0;
+}
+
+// Releases the cached modes of the display at the given index.
+static void InvalidateDisplayModes(struct DisplayState * state,
+                                   uint32_t display_index) {
+    if (state->modes[display_index]) {
+        CFRelease(state->modes[display_index]);
+        state->modes[display_index] = NULL;
+    }
+    FreeModeTable(state->mode_tables[display_index]);
+    state->mode_tables[display_index] = NULL;
+}
+
+// Discards the modes copied with options other than `mode_options', so that
+// GetDisplayModes copies them again with the new options.  Must not be called
+// while modes are being loaded concurrently.
+static void SelectModeOptions(struct DisplayState * state,
+                              CFDictionaryRef mode_options) {
+    if (state->mode_options == mode_options) {
+        return;
+    }
+    for (uint32_t i = 0; i < kMaxDisplays; ++i) {
+        InvalidateDisplayModes(state, i);
+    }
+    state->mode_options = mode_options;
+}
+
+// Re-fetches the active display list, keeping the modes already copied for
+// displays that are still active.
+static CGError RefreshActiveDisplays(const struct Session * session) {
+    struct DisplayState * const state = session->state;
+    CGDirectDisplayID displays[kMaxDisplays];
+    uint32_t num_displays;
+    const struct PhaseTimer timer = BeginPhase(kPhaseDisplayList);
+    CGError e = CGGetActiveDisplayList(kMaxDisplays, &displays[0],
+                                       &num_displays);
+    EndPhase(session, &timer);
+    if (e) {
+        fprintf(session->err, "CGGetActiveDisplayList CGError: %d\n", e);
+        InvalidateDisplayState(state);
+        return e;
+    }
+
+    CFArrayRef modes[kMaxDisplays] = { NULL };
+    struct ModeTable * tables[kMaxDisplays] = { NULL };
+    for (uint32_t i = 0; i < num_displays; ++i) {
+        for (uint32_t j = 0; j < state->num_displays; ++j) {
+            if (state->displays[j] == displays[i]) {
+                modes[i] = state->modes[j];
+                tables[i] = state->mode_tables[j];
+                state->modes[j] = NULL;
+                state->mode_tables[j] = NULL;
+            }
+        }
+    }
+    InvalidateDisplayState(state);
+    memcpy(state->displays, displays, sizeof(displays));
+    memcpy(state->modes, modes, sizeof(modes));
+    memcpy(state->mode_tables, tables, sizeof(tables));
+    state->num_displays = num_displays;
+    state->has_displays = true;
+    return kCGErrorSuccess;
+}
+
+// Header of a mode cache file, followed by the columns of a ModeTable with
+// `count' rows.
+//
+// Each file holds the modes of one display, named by its vendor, model and
+// serial numbers.  The file is stale if the display ID, the set of active
+// displays or the display's mirroring differs from when it was written, since
+// mirroring changes which modes a display offers without changing the set.
+struct ModeCacheHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t display_set_hash;
+    CGDirectDisplayID display;
+    CGDirectDisplayID mirrors;  // CGDisplayMirrorsDisplay
+    uint32_t hw_mirror;  // CGDisplayIsInHWMirrorSet
+    uint32_t count;
+};
+
+static const char kModeCacheMagic[4] = { 'D', 'M', 'M', 'C' };
+static const uint32_t kModeCacheVersion = 3;
+
+// Upper bound on the number of modes read from a cache file.
+static const uint32_t kMaxCachedModes = 4096;
+
+// Returns an FNV-1a hash of the active display list, used to detect changes
+// in the set of displays.
+static uint32_t GetDisplaySetHash(const struct DisplayState * state) {
+    uint32_t hash = 2166136261u;
+    const unsigned char * bytes = (const unsigned char *) state->displays;
+    const size_t length = state->num_displays * sizeof(state->displays[0]);
+    for (size_t i = 0; i < length; ++i) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Writes the path of the cache file for `display' into `path', which differs
+// for lists that include low-resolution modes.  Identical panels may share a
+// vendor, model and serial number (often 0), so the display ID is included to
+// keep their caches apart.  Returns false if the directory could not be
+// determined or the path is too long.
+static bool GetModeCachePath(const char * cache_dir, CGDirectDisplayID display,
+                             bool low_resolution, char path[PATH_MAX]) {
+    char default_dir[PATH_MAX];
+    if (cache_dir[0] == '\0') {
+        const char * home = getenv("HOME");
+        if (NULL == home) {
+            return false;
+        }
+        const int n = snprintf(default_dir, sizeof(default_dir),
+                               "%s/Library/Caches/displaymode", home);
+        if (n < 0 || (size_t) n >= sizeof(default_dir)) {
+            return false;
+        }
+        cache_dir = default_dir;
+    }
+    mkdir(cache_dir, 0755);
+    const int n = snprintf(path, PATH_MAX, "%s/%08x-%08x-%08x-%u%s.modes",
+                           cache_dir, CGDisplayVendorNumber(display),
+                           CGDisplayModelNumber(display),
+                           CGDisplaySerialNumber(display), display,
+                           low_resolution ? "-low-resolution" : "");
+    return 0 <= n && n < PATH_MAX;
+}
+
+// Reads the cached mode table for `display' from `path'.  Returns NULL if the
+// cache is missing or stale.  The caller owns the returned table.
+static struct ModeTable * ReadModeCache(const char * path,
+                                        CGDirectDisplayID display,
+                                        uint32_t display_set_hash) {
+    FILE * file = fopen(path, "rb");
+    if (NULL == file) {
+        return NULL;
+    }
+    struct ModeTable * table = NULL;
+    struct ModeCacheHeader header;
+    if (1 == fread(&header, sizeof(header), 1, file) &&
+        0 == memcmp(header.magic, kModeCacheMagic, sizeof(header.magic)) &&
+        header.version == kModeCacheVersion &&
+        header.display_set_hash == display_set_hash &&
+        header.display == display &&
+        header.mirrors == CGDisplayMirrorsDisplay(display) &&
+        header.hw_mirror == (uint32_t) !!CGDisplayIsInHWMirrorSet(display) &&
+        0 < header.count && header.count <= kMaxCachedModes &&
+        NULL != (table = AllocateModeTable(header.count))) {
+        const size_t n = header.count;
+        const bool read =
+            n == fread(table->widths, sizeof(*table->widths), n, file) &&
+            n == fread(table->heights, sizeof(*table->heights), n, file) &&
+            n == fread(table->pixel_widths,
+                       sizeof(*table->pixel_widths), n, file) &&
+            n == fread(table->pixel_heights,
+                       sizeof(*table->pixel_heights), n, file) &&
+            n == fread(table->refresh_rates,
+                       sizeof(*table->refresh_rates), n, file) &&
+            n == fread(table->io_mode_ids,
+                       sizeof(*table->io_mode_ids), n, file) &&
+            n == fread(table->io_flags, sizeof(*table->io_flags), n, file) &&
+            n == fread(table->usable_for_desktop,
+                       sizeof(*table->usable_for_desktop), n, file);
+        if (read && IndexModeTable(table)) {
+            table->from_cache = true;
+        } else {
+            FreeModeTable(table);
+            table = NULL;
+        }
+    }
+    fclose(file);
+    return table;
+}
+
+// Replaces the cache file at `path'.  Failures are ignored, since the cache
+// will simply be rebuilt next time.
+static void WriteModeCache(const char * path, CGDirectDisplayID display,
+                           uint32_t display_set_hash,
+                           const struct ModeTable * table) {
+    // The temporary file must be unique, since other processes, or other
+    // threads loading mode tables, may be writing the same cache.
+    char temp_path[PATH_MAX];
+    const int n = snprintf(temp_path, sizeof(temp_path), "%s.XXXXXX", path);
+    if (n < 0 || (size_t) n >= sizeof(temp_path)) {
+        return;
+    }
+    const int fd = mkstemp(temp_path);
+    if (fd < 0) {
+        return;
+    }
+    FILE * file = fdopen(fd, "wb");
+    if (NULL == file) {
+        close(fd);
+        unlink(temp_path);
+        return;
+    }
+    const size_t count = table->count;
+    struct ModeCacheHeader header = {
+        .version = kModeCacheVersion,
+        .display_set_hash = display_set_hash,
+        .display = display,
+        .mirrors = CGDisplayMirrorsDisplay(display),
+        .hw_mirror = !!CGDisplayIsInHWMirrorSet(display),
+        .count = (uint32_t) count,
+    };
+    memcpy(header.magic, kModeCacheMagic, sizeof(header.magic));
+    const bool written =
+        1 == fwrite(&header, sizeof(header), 1, file) &&
+        count == fwrite(table->widths, sizeof(*table->widths), count, file) &&
+        count == fwrite(table->heights,
+                        sizeof(*table->heights), count, file) &&
+        count == fwrite(table->pixel_widths,
+                        sizeof(*table->pixel_widths), count, file) &&
+        count == fwrite(table->pixel_heights,
+                        sizeof(*table->pixel_heights), count, file) &&
+        count == fwrite(table->refresh_rates,
+                        sizeof(*table->refresh_rates), count, file) &&
+        count == fwrite(table->io_mode_ids,
+                        sizeof(*table->io_mode_ids), count, file) &&
+        count == fwrite(table->io_flags,
+                        sizeof(*table->io_flags), count, file) &&
+        count == fwrite(table->usable_for_desktop,
+                        sizeof(*table->usable_for_desktop), count, file);
+    if (0 == fclose(file) && written) {
+        rename(temp_path, path);
+    } else {
+        unlink(temp_path);
+    }
+}
+
+// Returns the mode table for the display at the given index.  If `cache_dir'
+// is non-NULL, the table is read from the on-disk cache there when fresh, and
+// the cache is otherwise rewritten.  If `cache_dir' is NULL, the table's rows
+// are guaranteed to correspond to GetDisplayModes.  The state retains
+// ownership of the returned table.  Returns NULL on failure.
+static const struct ModeTable * GetModeTable(const struct Session * session,
+                                             uint32_t display_index,
+                                             const char * cache_dir) {
+    struct DisplayState * const state = session->state;
+    struct ModeTable * table = state->mode_tables[display_index];
+    if (table && (cache_dir || !table->from_cache)) {
+        return table;
+    }
+    FreeModeTable(table);
+    state->mode_tables[display_index] = table = NULL;
+
+    const CGDirectDisplayID display = state->displays[display_index];
+    const uint32_t display_set_hash = GetDisplaySetHash(state);
+    char path[PATH_MAX];
+    const bool use_cache =
+        cache_dir && GetModeCachePath(cache_dir, display,
+                                      session->mode_options != NULL, path);
+    if (use_cache) {
+        const struct PhaseTimer timer = BeginPhase(kPhaseModeTable);
+        table = ReadModeCache(path, display, display_set_hash);
+        EndPhase(session, &timer);
+    }
+
+    if (NULL == table) {
+        CFArrayRef modes = GetDisplayModes(session, display_index);
+        if (NULL == modes) {
+            return NULL;
+        }
+        const struct PhaseTimer timer = BeginPhase(kPhaseModeTable);
+        table = CreateModeTable(modes);
+        if (table && use_cache) {
+            WriteModeCache(path, display, display_set_hash, table);
+        }
+        EndPhase(session, &timer);
+        if (NULL == table) {
+            return NULL;
+        }
+    }
+
+    state->mode_tables[display_index] = table;
+    return table;
+}
+
+// Prints the resolution and refresh rate for a display mode and, if
+// `show_cost', its framebuffer size and scanout bandwidth.
+static void PrintMode(FILE * out, const struct ModeInfo * info,
+                      bool show_cost) {
+    fprintf(out, "%u x %u", info->width, info->height);
+    // Show the backing size of scaled (HiDPI) modes.
+    if (info->pixel_width != info->width ||
+        info->pixel_height != info->height) {
+        fprintf(out, " (%u x %u pixels, x%g)", info->pixel_width,
+                info->pixel_height,
+                GetModeScale(info->width, info->pixel_width));
+    }
+    fprintf(out, " @%.1fHz", info->refresh_rate);
+    if (show_cost) {
+        fprintf(out, " [%.1f MB, %.2f GB/s]",
+                GetFramebufferBytes(info->pixel_width,
+                                    info->pixel_height) / 1e6,
+                GetScanoutBandwidth(info->pixel_width, info->pixel_height,
+                                    info->refresh_rate) / 1e9);
+    }
+    fputs(info->usable_for_desktop ? "" : " !", out);
+}
+
+static const char kModeRecordTSVHeader[] =
+    "display\tdisplay_id\tindex\twidth\theight\tpixel_width\t"
+    "pixel_height\trefresh_rate\tusable\tio_flags\tcurrent\t"
+    "framebuffer_bytes\tbandwidth\n";
+
+// Prints one machine-readable record for a mode.  `row' is the mode's index
+// in the display's mode list, or -1 if the mode is not in the list.
+static void PrintModeRecord(FILE * out, enum OutputFormat format,
+                            uint32_t display_index, CGDirectDisplayID display,
+                            long row, const struct ModeInfo * info,
+                            bool current) {
+    const double framebuffer_bytes =
+        GetFramebufferBytes(info->pixel_width, info->pixel_height);
+    const double bandwidth = GetScanoutBandwidth(
+        info->pixel_width, info->pixel_height, info->refresh_rate);
+    if (format == kFormatJSON) {
+        char index[24] = "null";
+        if (0 <= row) {
+            snprintf(index, sizeof(index), "%ld", row);
+        }
+        fprintf(out,
+                "{\"display\":%u,\"display_id\":%u,\"index\":%s,"
+                "\"width\":%u,\"height\":%u,\"pixel_width\":%u,"
+                "\"pixel_height\":%u,\"refresh_rate\":%.3f,"
+                "\"usable\":%s,\"io_flags\":%u,\"current\":%s,"
+                "\"framebuffer_bytes\":%.0f,\"bandwidth\":%.0f}\n",
+                display_index, display, index, info->width, info->height,
+                info->pixel_width, info->pixel_height, info->refresh_rate,
+                info->usable_for_desktop ? "true" : "false", info->io_flags,
+                current ? "true" : "false", framebuffer_bytes, bandwidth);
+    } else {
+        fprintf(out,
+                "%u\t%u\t%ld\t%u\t%u\t%u\t%u\t%.3f\t%d\t%u\t%d\t%.0f\t"
+                "%.0f\n",
+                display_index, display, row, info->width, info->height,
+                info->pixel_width, info->pixel_height, info->refresh_rate,
+                info->usable_for_desktop ? 1 : 0, info->io_flags,
+                current ? 1 : 0, framebuffer_bytes, bandwidth);
+    }
+}
+
+// Prints all display modes for the display at the given index.  Returns 0 on
+// success.
+static int PrintModes(const struct Session * session,
+                      const struct ParsedArgs * parsed_args,
+                      uint32_t display_index) {
+    FILE * const out = session->out;
+    const enum OutputFormat format = parsed_args->format;
+    const CGDirectDisplayID display = session->state->displays[display_index];
+    struct ModeInfo current_info;
+    GetModeInfo(GetCurrentMode(session, display_index), &current_info);
+
+    const struct ModeTable * table =
+        GetModeTable(session, display_index, parsed_args->cache_dir);
+    if (NULL == table) {
+        fprintf(session->err, "Could not get modes for display %u\n",
+                display_index);
+        return kCGErrorFailure;
+    }
+
+    bool has_current = false;
+    for (size_t i = 0; i < table->count; ++i) {
+        struct ModeInfo info;
+        GetModeTableRow(table, i, &info);
+        const bool current =
+            !has_current && IsSameModeInfo(&info, &current_info);
+        has_current |= current;
+        if (format != kFormatText) {
+            PrintModeRecord(out, format, display_index, display, (long) i,
+                            &info, current);
+            continue;
+        }
+        PrintMode(out, &info, true);
+        fputs(current ? " *\n" : "\n", out);
+    }
+    if (!has_current) {
+        if (format != kFormatText) {
+            PrintModeRecord(out, format, display_index, display, -1,
+                            &current_info, true);
+        } else {
+            PrintMode(out, &current_info, true);
+            fputs(" *\n", out);
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+// Loads the mode tables of several displays concurrently.  Each display's
+// phases are timed separately and then summed into the session's timings.
+struct ModeTableLoad {
+    const struct Session * session;
+    const char * cache_dir;
+    const uint32_t * display_indexes;
+    struct Timings timings[kMaxDisplays];
+};
+
+static void LoadModeTable(void * context, size_t i) {
+    struct ModeTableLoad * const load = context;
+    struct Session session = *load->session;
+    if (session.timings) {
+        session.timings = &load->timings[i];
+    }
+    GetModeTable(&session, load->display_indexes[i], load->cache_dir);
+}
+
+// Loads the mode tables of the `count' displays at `display_indexes' in
+// parallel, so that slow displays or adapters don't delay each other.
+static void LoadModeTables(const struct Session * session,
+                           const char * cache_dir,
+                           const uint32_t * display_indexes, uint32_t count) {
+    const struct DisplayState * const state = session->state;
+    uint32_t num_missing = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        num_missing += NULL == state->mode_tables[display_indexes[i]];
+    }
+    if (num_missing < 2) {
+        return;
+    }
+
+    struct ModeTableLoad load = {
+        .session = session,
+        .cache_dir = cache_dir,
+        .display_indexes = display_indexes,
+    };
+    dispatch_apply_f(count,
+                     dispatch_get_global_queue(QOS_CLASS_USER_INITIATED, 0),
+                     &load, LoadModeTable);
+    if (session->timings) {
+        for (uint32_t i = 0; i < count; ++i) {
+            for (int phase = 0; phase < kNumPhases; ++phase) {
+                session->timings->nanoseconds[phase] +=
+                    load.timings[i].nanoseconds[phase];
+                session->timings->counts[phase] +=
+                    load.timings[i].counts[phase];
+            }
+        }
+    }
+}
+
+// Returns the index of `display' in the active display list, or -1.
+static int FindDisplayIndex(const struct DisplayState * state,
+                            CGDirectDisplayID display) {
+    for (uint32_t i = 0; i < state->num_displays; ++i) {
+        if (state->displays[i] == display) {
+            return (int) i;
+        }
+    }
+    return -1;
+}
+
+// Prints the heading for a display's modes, noting whether it is the main
+// display and how it is mirrored.  Displays in a hardware mirror set share
+// one framebuffer; software mirrors are composited from the display they
+// mirror.
+static void PrintDisplayHeading(const struct Session * session,
+                                uint32_t display_index) {
+    FILE * const out = session->out;
+    const CGDirectDisplayID display = session->state->displays[display_index];
+    const CGDirectDisplayID mirrored = CGDisplayMirrorsDisplay(display);
+    fprintf(out, "Display %u", display_index);
+    const char * separator = " (";
+    if (display_index == 0) {
+        fprintf(out, "%sMAIN", separator);
+        separator = ", ";
+    }
+    if (CGDisplayIsInHWMirrorSet(display)) {
+        fprintf(out, "%shardware mirrored", separator);
+        separator = ", ";
+    } else if (mirrored != kCGNullDirectDisplay) {
+        const int mirrored_index =
+            FindDisplayIndex(session->state, mirrored);
+        if (0 <= mirrored_index) {
+            fprintf(out, "%ssoftware mirror of display %d", separator,
+                    mirrored_index);
+        } else {
+            fprintf(out, "%ssoftware mirror of display ID %u", separator,
+                    mirrored);
+        }
+        separator = ", ";
+    }
+    fputs(separator[0] == ',' ? "):\n" : ":\n", out);
+}
+
+// Returns the display ID (arbitrary integers) corresponding to the given
+// display index (0-indexed).
+static CGError GetDisplayID(const struct Session * session,
+                            uint32_t display_index,
+                            CGDirectDisplayID * display) {
+    CGError e;
+    if ((e = GetActiveDisplays(session))) {
+        return e;
+    }
+    const uint32_t num_displays = session->state->num_displays;
+    if (num_displays <= display_index) {
+        fprintf(session->err,
+                "Display %u not supported; display must be < %u\n",
+                display_index, num_displays);
+        return kCGErrorRangeCheck;
+    }
+    *display = session->state->displays[display_index];
+    return kCGErrorSuccess;
+}
+
+static void GetDisplayIdentity(CGDirectDisplayID display,
+                               struct DisplayIdentity * identity) {
+    identity->vendor = CGDisplayVendorNumber(display);
+    identity->model = CGDisplayModelNumber(display);
+    identity->serial = CGDisplaySerialNumber(display);
+}
+
+static bool IsSameDisplayIdentity(const struct DisplayIdentity * a,
+                                  const struct DisplayIdentity * b) {
+    return a->vendor == b->vendor && a->model == b->model &&
+           a->serial == b->serial;
+}
+
+// Finds the index of the active display with the given identity.  Fails if
+// no display, or more than one display, has that identity.
+static CGError FindDisplayWithIdentity(const struct Session * session,
+                                       const struct DisplayIdentity * identity,
+                                       uint32_t * display_index) {
+    const struct DisplayState * const state = session->state;
+    uint32_t num_found = 0;
+    for (uint32_t i = 0; i < state->num_displays; ++i) {
+        struct DisplayIdentity candidate;
+        GetDisplayIdentity(state->displays[i], &candidate);
+        if (IsSameDisplayIdentity(&candidate, identity)) {
+            *display_index = i;
+            ++num_found;
+        }
+    }
+    if (1 != num_found) {
+        fprintf(session->err, "%s display has identity %08x-%08x-%08x\n",
+                num_found ? "More than one" : "No active",
+                identity->vendor, identity->model, identity->serial);
+        return kCGErrorRangeCheck;
+    }
+    return kCGErrorSuccess;
+}
+
+// Sets `*index' to the index of the active display named by `name', unless
+// it is already an index.  Displays named by ID or UUID are looked up
+// directly rather than by comparing every display.
+static CGError FindSelectedDisplay(const struct Session * session,
+                                   const struct DisplayName * name,
+                                   uint32_t * index) {
+    CGError e;
+    if ((e = GetActiveDisplays(session))) {
+        return e;
+    }
+    CGDirectDisplayID display = name->display_id;
+    switch (name->selector) {
+        case kSelectDisplayIndex:
+            return kCGErrorSuccess;
+
+        case kSelectDisplayIdentity:
+            return FindDisplayWithIdentity(session, &name->identity, index);
+
+        case kSelectDisplayUUID: {
+            CFUUIDRef uuid =
+                CFUUIDCreateFromUUIDBytes(kCFAllocatorDefault, name->uuid);
+            display = uuid ? CGDisplayGetDisplayIDFromUUID(uuid) : 0;
+            if (uuid) {
+                CFRelease(uuid);
+            }
+            break;
+        }
+
+        case kSelectDisplayID:
+            break;
+    }
+    const int display_index = FindDisplayIndex(session->state, display);
+    if (display_index < 0) {
+        if (name->selector == kSelectDisplayID) {
+            fprintf(session->err, "No active display has ID %u\n", display);
+        } else {
+            fputs("No active display has that UUID\n", session->err);
+        }
+        return kCGErrorRangeCheck;
+    }
+    *index = (uint32_t) display_index;
+    return kCGErrorSuccess;
+}
+
+// Sets the index of each spec that names its display, or the display it
+// mirrors, other than by index, then checks that no display is named more
+// than once.
+static CGError ResolveDisplayIndexes(const struct Session * session,
+                                     struct ModeSpec * specs, uint32_t count) {
+    CGError e;
+    for (uint32_t i = 0; i < count; ++i) {
+        if ((e = FindSelectedDisplay(session, &specs[i].display,
+                                     &specs[i].display_index))) {
+            return e;
+        }
+        if (specs[i].mirror == kMirrorDisplay) {
+            if ((e = FindSelectedDisplay(session, &specs[i].mirror_of,
+                                         &specs[i].mirror_index))) {
+                return e;
+            }
+            if (specs[i].mirror_index == specs[i].display_index) {
+                fprintf(session->err, "Display %u can't mirror itself\n",
+                        specs[i].display_index);
+                return kCGErrorIllegalArgument;
+            }
+        }
+        for (uint32_t j = 0; j < i; ++j) {
+            if (specs[i].display_index == specs[j].display_index) {
+                fprintf(session->err, "Display %u specified more than once\n",
+                        specs[i].display_index);
+                return kCGErrorIllegalArgument;
+            }
+        }
+    }
+    return kCGErrorSuccess;
+}
+
+// Sets `display_indexes' to the indexes of the displays named for "c" and
+// "d", or of every active display if none were, and `*count' to their
+// number.  Fails if a display is named more than once, however it is named.
+static CGError GetSelectedDisplays(const struct Session * session,
+                                   const struct ParsedArgs * parsed_args,
+                                   uint32_t display_indexes[kMaxDisplays],
+                                   uint32_t * count) {
+    CGError e;
+    if ((e = GetActiveDisplays(session))) {
+        return e;
+    }
+    *count = parsed_args->num_displays;
+    if (0 == *count) {
+        *count = session->state->num_displays;
+        for (uint32_t i = 0; i < *count; ++i) {
+            display_indexes[i] = i;
+        }
+        return kCGErrorSuccess;
+    }
+    for (uint32_t i = 0; i < *count; ++i) {
+        CGDirectDisplayID display;
+        display_indexes[i] = parsed_args->display_indexes[i];
+        if ((e = FindSelectedDisplay(session, &parsed_args->displays[i],
+                                     &display_indexes[i])) ||
+            (e = GetDisplayID(session, display_indexes[i], &display))) {
+            return e;
+        }
+        // Each display's modes must be loaded by only one worker.
+        for (uint32_t j = 0; j < i; ++j) {
+            if (display_indexes[i] == display_indexes[j]) {
+                fprintf(session->err, "Display %u specified more than once\n",
+                        display_indexes[i]);
+                return kCGErrorIllegalArgument;
+            }
+        }
+    }
+    return kCGErrorSuccess;
+}
+
+// Prints the modes of the displays named for "d".  Only those displays'
+// modes are copied.
+static int PrintModesForDisplays(const struct Session * session,
+                                 const struct ParsedArgs * parsed_args) {
+    uint32_t display_indexes[kMaxDisplays];
+    uint32_t count;
+    CGError e;
+    if ((e = GetSelectedDisplays(session, parsed_args, display_indexes,
+                                 &count))) {
+        return e;
+    }
+    LoadModeTables(session, parsed_args->cache_dir, display_indexes, count);
+
+    if (parsed_args->format == kFormatTSV) {
+        fputs(kModeRecordTSVHeader, session->out);
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+        if (parsed_args->format == kFormatText) {
+            if (i != 0) {
+                fputc('\n', session->out);
+            }
+            PrintDisplayHeading(session, display_indexes[i]);
+        }
+        PrintModes(session, parsed_args, display_indexes[i]);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// Prints the current mode of the displays named for "c".  Unlike "d", this
+// never copies a display's list of modes, so it is cheap enough to poll.
+static int PrintCurrentModes(const struct Session * session,
+                             const struct ParsedArgs * parsed_args) {
+    FILE * const out = session->out;
+    const enum OutputFormat format = parsed_args->format;
+    uint32_t display_indexes[kMaxDisplays];
+    uint32_t count;
+    CGError e;
+    if ((e = GetSelectedDisplays(session, parsed_args, display_indexes,
+                                 &count))) {
+        return e;
+    }
+
+    if (format == kFormatTSV) {
+        fputs(kModeRecordTSVHeader, out);
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+        const CGDirectDisplayID display =
+            session->state->displays[display_indexes[i]];
+        CGDisplayModeRef mode = GetCurrentMode(session, display_indexes[i]);
+        if (NULL == mode) {
+            fprintf(session->err, "Could not get the mode of display %u\n",
+                    display_indexes[i]);
+            return kCGErrorFailure;
+        }
+        struct ModeInfo info;
+        GetModeInfo(mode, &info);
+        if (format != kFormatText) {
+            PrintModeRecord(out, format, display_indexes[i], display, -1,
+                            &info, true);
+            continue;
+        }
+        fprintf(out, "Display %u%s: ", display_indexes[i],
+                display_indexes[i] == 0 ? " (MAIN)" : "");
+        PrintMode(out, &info, false);
+        fputc('\n', out);
+    }
+    return EXIT_SUCCESS;
+}
+
+// Returns how far `actual' is outside the refresh rates allowed by `spec', or
+// 0 if it is allowed.
+//
+// Modes of displays that don't report their refresh rate, such as built-in
+// panels, have a rate of 0 Hz.  They are only allowed without limits.
+static double GetRefreshRateExcess(const struct ModeSpec * spec,
+                                   double actual) {
+    if (spec->refresh_pick == kRefreshPickExact) {
+        return MatchesRefreshRate(spec->refresh_rate, actual)
+            ? 0.0 : fabs(actual - spec->refresh_rate);
+    }
+    const double min = spec->min_refresh_rate;
+    const double max = spec->max_refresh_rate;
+    if (actual == 0.0 && (min != 0.0 || max != 0.0)) {
+        // An unknown rate can't be shown to be in range, even one from 0 Hz.
+        return HUGE_VAL;
+    }
+    if (actual < min - kRefreshTolerance) {
+        return min - actual;
+    }
+    if (max != 0.0 && max + kRefreshTolerance < actual) {
+        return actual - max;
+    }
+    return 0.0;
+}
+
+// Ranks an allowed refresh rate for `spec'.  Lower is better.  Rates of 0 Hz
+// rank below every reported rate.
+static double GetRefreshRateRank(const struct ModeSpec * spec, double actual) {
+    switch (spec->refresh_pick) {
+        case kRefreshPickHighest:
+            return -actual;
+        case kRefreshPickLowest:
+            return actual == 0.0 ? INFINITY : actual;
+        case kRefreshPickExact:
+        default:
+            return 0.0;
+    }
+}
+
+// Returns true if the mode in `row' is within the bandwidth limit of `spec'.
+static bool FitsBandwidth(const struct ModeSpec * spec,
+                          const struct ModeTable * table, size_t row) {
+    return !spec->limit_bandwidth ||
+        GetScanoutBandwidth(table->pixel_widths[row],
+                            table->pixel_heights[row],
+                            table->refresh_rates[row]) <= spec->max_bandwidth;
+}
+
+// Returns the row of the first mode whose resolution matches `spec' exactly
+// and whose refresh rate matches or, for "@max", "@min" and ranges, is the
+// best allowed at that resolution.  Returns -1 if none match.
+static long FindMatchingRow(const struct ModeSpec * spec,
+                            const struct ModeTable * table) {
+    long match = -1;
+    double match_rank = 0.0;
+    // Rows with the same resolution are adjacent in by_resolution, and in
+    // the same order as in the mode array.
+    for (size_t i = FindResolution(table, (uint32_t) spec->width,
+                                   (uint32_t) spec->height);
+         i < table->count; ++i) {
+        const uint32_t row = table->by_resolution[i];
+        if (table->widths[row] != spec->width ||
+            table->heights[row] != spec->height) {
+            break;
+        }
+        const double refresh_rate = table->refresh_rates[row];
+        if (!FitsBandwidth(spec, table, row) ||
+            0.0 != GetRefreshRateExcess(spec, refresh_rate) ||
+            !MatchesScale(spec->scale,
+                          GetModeScale(table->widths[row],
+                                       table->pixel_widths[row]))) {
+            continue;
+        }
+        if (spec->refresh_pick == kRefreshPickExact) {
+            return row;
+        }
+        const double rank = GetRefreshRateRank(spec, refresh_rate);
+        if (match < 0 || rank < match_rank - kRefreshTolerance) {
+            match = row;
+            match_rank = rank;
+        }
+    }
+    return match;
+}
+
+// How well a mode fits a "best" ModeSpec.  Lower is better for every
+// criterion.
+struct ModeScore {
+    int unusable;
+    double resolution_distance;
+    double aspect_distance;
+    double refresh_distance;
+    double refresh_rank;
+    double scale_distance;
+};
+
+static void ScoreMode(const struct ModeSpec * spec,
+                      const struct ModeTable * table, size_t row,
+                      struct ModeScore * score) {
+    const double width = table->widths[row];
+    const double height = table->heights[row];
+    const double refresh_rate = table->refresh_rates[row];
+    score->unusable = !table->usable_for_desktop[row];
+    score->resolution_distance =
+        fabs(width - (double) spec->width) / (double) spec->width +
+        fabs(height - (double) spec->height) / (double) spec->height;
+    score->aspect_distance = fabs(width / height -
+                                  (double) spec->width / (double) spec->height);
+    // Without a requested refresh rate, the highest is best.
+    const bool any_rate = spec->refresh_pick == kRefreshPickExact &&
+                          spec->refresh_rate == 0.0;
+    score->refresh_distance = GetRefreshRateExcess(spec, refresh_rate);
+    score->refresh_rank = any_rate ? -refresh_rate
+                                   : GetRefreshRateRank(spec, refresh_rate);
+    // Without a requested scale, the densest backing is best.
+    const double scale = GetModeScale(table->widths[row],
+                                      table->pixel_widths[row]);
+    score->scale_distance = spec->scale == 0.0
+        ? -scale : fabs(scale - spec->scale);
+}
+
+// Compares two doubles for ordering candidates, treating near-equal values as
+// ties.
+static int CompareScoreValues(double a, double b) {
+    static const double kEpsilon = 1e-6;
+    return a < b - kEpsilon ? -1 : a > b + kEpsilon;
+}
+
+// Returns negative if `a' fits better than `b' under `prefer', positive if
+// worse, and 0 if they are equally good.
+static int CompareModeScores(enum Preference prefer,
+                             const struct ModeScore * a,
+                             const struct ModeScore * b) {
+    const int usable = a->unusable - b->unusable;
+    const int resolution = CompareScoreValues(a->resolution_distance,
+                                              b->resolution_distance);
+    const int aspect = CompareScoreValues(a->aspect_distance,
+                                          b->aspect_distance);
+    int refresh = CompareScoreValues(a->refresh_distance,
+                                     b->refresh_distance);
+    if (!refresh) {
+        refresh = CompareScoreValues(a->refresh_rank, b->refresh_rank);
+    }
+    const int hidpi = CompareScoreValues(a->scale_distance,
+                                         b->scale_distance);
+    // The resolution always comes first, so a preference only decides
+    // between modes as close to the requested size, ahead of their aspect.
+    int order[5];
+    switch (prefer) {
+        case kPreferRefresh:
+            memcpy(order, (int[]) { usable, resolution, refresh, aspect,
+                                    hidpi }, sizeof(order));
+            break;
+        case kPreferHiDPI:
+            memcpy(order, (int[]) { usable, resolution, hidpi, aspect,
+                                    refresh }, sizeof(order));
+            break;
+        case kPreferResolution:
+        default:
+            memcpy(order, (int[]) { usable, resolution, aspect, refresh,
+                                    hidpi }, sizeof(order));
+            break;
+    }
+    for (size_t i = 0; i < sizeof(order) / sizeof(order[0]); ++i) {
+        if (order[i]) {
+            return order[i];
+        }
+    }
+    return 0;
+}
+
+// Returns the row of the mode that best fits `spec', scoring every mode in a
+// single pass.  Returns -1 if the table is empty.
+static long FindBestRow(const struct ModeSpec * spec,
+                        const struct ModeTable * table) {
+    long best_row = -1;
+    struct ModeScore best_score;
+    for (size_t row = 0; row < table->count; ++row) {
+        if (!FitsBandwidth(spec, table, row)) {
+            continue;
+        }
+        struct ModeScore score;
+        ScoreMode(spec, table, row, &score);
+        if (best_row < 0 ||
+            CompareModeScores(spec->prefer, &score, &best_score) < 0) {
+            best_row = (long) row;
+            best_score = score;
+        }
+    }
+    return best_row;
+}
+
+// Returns the mode in `modes' chosen for `spec': the first exact match, or
+// for "best" specifications, the closest mode.  `table' must describe
+// `modes'.  Returns NULL if no modes matched.  The caller owns the returned
+// mode.
+static CGDisplayModeRef GetModeMatching(const struct ModeSpec * spec,
+                                        const struct ModeTable * table,
+                                        CFArrayRef modes) {
+    const long row = spec->best
+        ? FindBestRow(spec, table) : FindMatchingRow(spec, table);
+    if (row < 0) {
+        return NULL;
+    }
+    return CGDisplayModeRetain(
+        (CGDisplayModeRef) CFArrayGetValueAtIndex(modes, row));
+}
+
+// A mode matched for a ModeSpec, along with the display's mode beforehand.
+struct ResolvedMode {
+    const struct ModeSpec * spec;
+    CGDirectDisplayID display;
+    CGDisplayModeRef mode;
+    CGDisplayModeRef original_mode;
+    bool unchanged;  // `mode' is already current, so needn't be configured
+    // The display to mirror (kCGNullDirectDisplay for none) and the origin to
+    // configure along with the mode, and what they were before.
+    bool set_mirror;
+    CGDirectDisplayID mirror;
+    CGDirectDisplayID original_mirror;
+    bool set_origin;
+    CGPoint origin;
+    CGPoint original_origin;
+    bool rearranged;  // the mirror or origin needs to be configured
+};
+
+// Returns the configuration that undoes `resolved'.
+static struct ResolvedMode GetRestoringMode(
+    const struct ResolvedMode * resolved) {
+    struct ResolvedMode restore = *resolved;
+    restore.mode = resolved->original_mode;
+    restore.original_mode = resolved->mode;
+    restore.mirror = resolved->original_mirror;
+    restore.original_mirror = resolved->mirror;
+    restore.origin = resolved->original_origin;
+    restore.original_origin = resolved->origin;
+    return restore;
+}
+
+// Finds the display and mode for `spec'.  On success, the caller must release
+// `resolved' with ReleaseResolvedModes.
+static int ResolveMode(const struct Session * session,
+                       const struct ModeSpec * spec,
+                       struct ResolvedMode * resolved) {
+    FILE * const err = session->err;
+    CGDirectDisplayID display;
+    CGError e;
+    if ((e = GetDisplayID(session, spec->display_index, &display))) {
+        return e;
+    }
+
+    CFArrayRef modes = GetDisplayModes(session, spec->display_index);
+    const struct ModeTable * table =
+        GetModeTable(session, spec->display_index, NULL);
+    if (NULL == modes || NULL == table) {
+        fprintf(err, "Could not get modes for display %u\n",
+                spec->display_index);
+        return kCGErrorFailure;
+    }
+
+    const struct PhaseTimer timer = BeginPhase(kPhaseMatching);
+    CGDisplayModeRef mode = GetModeMatching(spec, table, modes);
+    EndPhase(session, &timer);
+    if (NULL == mode) {
+        if (spec->refresh_pick != kRefreshPickExact) {
+            fprintf(err, "Could not find a mode for resolution %lux%lu"
+                    " with an allowed refresh rate\n",
+                    spec->width, spec->height);
+        } else if (spec->refresh_rate == 0.0) {
+            fprintf(err, "Could not find a mode for resolution %lux%lu\n",
+                    spec->width, spec->height);
+        } else {
+            fprintf(err, "Could not find a mode for resolution %lux%lu"
+                    " @%.1f\n",
+                    spec->width, spec->height, spec->refresh_rate);
+        }
+        if (spec->limit_bandwidth) {
+            fprintf(err, "Only modes within the %.2f GB/s left of"
+                    " --max-bandwidth were considered\n",
+                    fmax(spec->max_bandwidth, 0.0) / 1e9);
+        }
+        return -1;
+    }
+
+    CGDirectDisplayID mirror = kCGNullDirectDisplay;
+    if (spec->mirror == kMirrorDisplay &&
+        (e = GetDisplayID(session, spec->mirror_index, &mirror))) {
+        CGDisplayModeRelease(mode);
+        return e;
+    }
+
+    resolved->spec = spec;
+    resolved->display = display;
+    resolved->mode = mode;
+    resolved->original_mode =
+        CGDisplayModeRetain(GetCurrentMode(session, spec->display_index));
+    resolved->unchanged = false;
+    resolved->set_mirror = spec->mirror != kMirrorUnchanged;
+    resolved->mirror = mirror;
+    resolved->original_mirror = CGDisplayMirrorsDisplay(display);
+    resolved->set_origin = spec->set_origin;
+    resolved->origin = CGPointMake(spec->origin_x, spec->origin_y);
+    resolved->original_origin = CGDisplayBounds(display).origin;
+    resolved->rearranged = resolved->set_mirror || resolved->set_origin;
+    return EXIT_SUCCESS;
+}
+
+static void ReleaseResolvedModes(struct ResolvedMode * resolved,
+                                 uint32_t count) {
+    for (uint32_t i = 0; i < count; ++i) {
+        CGDisplayModeRelease(resolved[i].mode);
+        CGDisplayModeRelease(resolved[i].original_mode);
+    }
+}
+
+// The reconfigured displays whose completion notifications are awaited.
+struct SettleWaiter {
+    uint32_t count;
+    uint32_t num_settled;
+    CGDirectDisplayID displays[kMaxDisplays];
+    bool settled[kMaxDisplays];
+};
+
+// Records the completion notification for a display being waited on.
+static void NoteDisplaySettled(CGDirectDisplayID display,
+                               CGDisplayChangeSummaryFlags flags,
+                               void * user_info) {
+    struct SettleWaiter * const waiter = user_info;
+    if (flags & kCGDisplayBeginConfigurationFlag) {
+        return;
+    }
+    for (uint32_t i = 0; i < waiter->count; ++i) {
+        if (waiter->displays[i] == display && !waiter->settled[i]) {
+            waiter->settled[i] = true;
+            ++waiter->num_settled;
+        }
+    }
+}
+
+// Registers for notifications about the displays that will be changed.  This
+// must happen before the configuration is committed.
+static void StartSettleWait(struct SettleWaiter * waiter,
+                            const struct ResolvedMode * resolved,
+                            uint32_t count) {
+    *waiter = (struct SettleWaiter) { 0 };
+    for (uint32_t i = 0; i < count; ++i) {
+        if (!resolved[i].unchanged || resolved[i].rearranged) {
+            waiter->displays[waiter->count++] = resolved[i].display;
+        }
+    }
+    CGDisplayRegisterReconfigurationCallback(NoteDisplaySettled, waiter);
+}
+
+// Runs the run loop until every display has settled or `timeout' elapses.
+// Returns true if every display settled.
+static bool WaitForSettle(struct SettleWaiter * waiter,
+                          CFTimeInterval timeout) {
+    const CFAbsoluteTime deadline = CFAbsoluteTimeGetCurrent() + timeout;
+    while (waiter->num_settled < waiter->count) {
+        const CFTimeInterval remaining =
+            deadline - CFAbsoluteTimeGetCurrent();
+        if (remaining <= 0 ||
+            kCFRunLoopRunFinished ==
+                CFRunLoopRunInMode(kCFRunLoopDefaultMode, remaining, true)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void StopSettleWait(struct SettleWaiter * waiter) {
+    CGDisplayRemoveReconfigurationCallback(NoteDisplaySettled, waiter);
+}
+
+// Returns the CGCompleteDisplayConfiguration option for `scope'.
+static CGConfigureOption GetConfigureOption(enum ConfigureScope scope) {
+    switch (scope) {
+        case kScopeSession:
+            return kCGConfigureForSession;
+        case kScopeApp:
+            return kCGConfigureForAppOnly;
+        case kScopeDefault:
+        case kScopePermanent:
+        default:
+            return kCGConfigurePermanently;
+    }
+}
+
+// How display configurations are committed.
+struct CommitOptions {
+    enum ConfigureScope scope;
+    bool fade;  // use the fade times below instead of the default fade
+    CGDisplayFadeInterval fade_out;
+    CGDisplayFadeInterval fade_in;
+};
+
+static struct CommitOptions GetCommitOptions(
+    const struct ParsedArgs * parsed_args) {
+    const struct CommitOptions options = {
+        .scope = parsed_args->scope,
+        .fade = parsed_args->fade,
+        .fade_out = (CGDisplayFadeInterval) parsed_args->fade_out,
+        .fade_in = (CGDisplayFadeInterval) parsed_args->fade_in,
+    };
+    return options;
+}
+
+// Configures the display arrangement for `resolved'.
+static CGError ConfigureArrangement(FILE * err, CGDisplayConfigRef config,
+                                    const struct ResolvedMode * resolved) {
+    CGError e;
+    if (resolved->set_mirror &&
+        (e = CGConfigureDisplayMirrorOfDisplay(config, resolved->display,
+                                               resolved->mirror))) {
+        fprintf(err, "CGConfigureDisplayMirrorOfDisplay CGError: %d\n", e);
+        return e;
+    }
+    if (resolved->set_origin &&
+        (e = CGConfigureDisplayOrigin(config, resolved->display,
+                                      (int32_t) resolved->origin.x,
+                                      (int32_t) resolved->origin.y))) {
+        fprintf(err, "CGConfigureDisplayOrigin CGError: %d\n", e);
+        return e;
+    }
+    return kCGErrorSuccess;
+}
+
+// Configures and commits the changed modes, mirroring and origins in one
+// transaction, so that the displays are reconfigured together.
+static CGError CommitModes(const struct Session * session,
+                           const struct ResolvedMode * resolved,
+                           uint32_t count,
+                           const struct CommitOptions * options) {
+    FILE * const err = session->err;
+    CGDisplayConfigRef config;
+    CGError e;
+    if ((e = CGBeginDisplayConfiguration(&config))) {
+        fprintf(err, "CGBeginDisplayConfiguration CGError: %d\n", e);
+        return e;
+    }
+    const struct PhaseTimer configure_timer = BeginPhase(kPhaseConfigure);
+    // Fade to and from black.
+    if (options->fade &&
+        (e = CGConfigureDisplayFadeEffect(config, options->fade_out,
+                                          options->fade_in, 0, 0, 0))) {
+        EndPhase(session, &configure_timer);
+        fprintf(err, "CGConfigureDisplayFadeEffect CGError: %d\n", e);
+        CGCancelDisplayConfiguration(config);
+        return e;
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+        if (resolved[i].rearranged &&
+            (e = ConfigureArrangement(err, config, &resolved[i]))) {
+            EndPhase(session, &configure_timer);
+            CGCancelDisplayConfiguration(config);
+            return e;
+        }
+        if (resolved[i].unchanged) {
+            continue;
+        }
+        if ((e = CGConfigureDisplayWithDisplayMode(
+                 config, resolved[i].display, resolved[i].mode, NULL))) {
+            EndPhase(session, &configure_timer);
+            fprintf(err, "CGConfigureDisplayWithDisplayMode CGError: %d\n",
+                    e);
+            CGCancelDisplayConfiguration(config);
+            return e;
+        }
+    }
+    EndPhase(session, &configure_timer);
+
+    const struct PhaseTimer commit_timer = BeginPhase(kPhaseCommit);
+    if (session->reconfigured) {
+        *session->reconfigured = true;
+    }
+    e = CGCompleteDisplayConfiguration(config,
+                                       GetConfigureOption(options->scope));
+    EndPhase(session, &commit_timer);
+    if (e) {
+        fprintf(err, "CGCompleteDisplayConfiguration CGError: %d\n", e);
+        return e;
+    }
+    return kCGErrorSuccess;
+}
+
+// Sets all the changed modes and arrangements in a single display
+// configuration transaction, so that the displays are only reconfigured
+// once.  Does nothing if every mode and arrangement is unchanged.  If
+// `settle_timeout' is positive, also waits up to that long for the changed
+// displays to finish reconfiguring; if `require_settle' then timing out is an
+// error.  Unless `committed' is NULL, sets it to whether the configuration
+// was committed, so that a failure to settle can be told from a rejection.
+static int ApplyModes(const struct Session * session,
+                      const struct ResolvedMode * resolved, uint32_t count,
+                      const struct CommitOptions * options,
+                      CFTimeInterval settle_timeout, bool require_settle,
+                      bool * committed) {
+    bool has_changes = false;
+    for (uint32_t i = 0; i < count; ++i) {
+        has_changes |= !resolved[i].unchanged || resolved[i].rearranged;
+    }
+    if (committed) {
+        *committed = !has_changes;
+    }
+    if (!has_changes) {
+        return kCGErrorSuccess;
+    }
+
+    const bool wait = 0 < settle_timeout;
+    struct SettleWaiter waiter;
+    if (wait) {
+        StartSettleWait(&waiter, resolved, count);
+    }
+    int status = CommitModes(session, resolved, count, options);
+    if (committed) {
+        *committed = kCGErrorSuccess == status;
+    }
+    // Even a failed commit may have changed some displays.
+    InvalidateCurrentModes(session->state);
+    if (wait) {
+        if (kCGErrorSuccess == status) {
+            const struct PhaseTimer timer = BeginPhase(kPhaseSettle);
+            if (!WaitForSettle(&waiter, settle_timeout)) {
+                fputs("Timed out waiting for displays to settle\n",
+                      session->err);
+                if (require_settle) {
+                    status = EXIT_FAILURE;
+                }
+            }
+            EndPhase(session, &timer);
+        }
+        StopSettleWait(&waiter);
+    }
+    return status;
+}
+
+// Prints a summary of the change made for `resolved'.
+static void PrintModeChange(FILE * out, const struct ResolvedMode * resolved) {
+    const struct ModeSpec * const spec = resolved->spec;
+    const size_t original_width =
+        CGDisplayModeGetWidth(resolved->original_mode);
+    const size_t original_height =
+        CGDisplayModeGetHeight(resolved->original_mode);
+    const double original_refresh_rate =
+        CGDisplayModeGetRefreshRate(resolved->original_mode);
+    // The chosen mode may differ from the requested one for "best".
+    const size_t width = CGDisplayModeGetWidth(resolved->mode);
+    const size_t height = CGDisplayModeGetHeight(resolved->mode);
+    const double refresh_rate = CGDisplayModeGetRefreshRate(resolved->mode);
+    if (resolved->unchanged) {
+        fprintf(out, "Display resolution is already %zux%zu @%.1f\n",
+                original_width, original_height, original_refresh_rate);
+    } else if (spec->refresh_rate == 0.0 && !spec->best &&
+               spec->refresh_pick == kRefreshPickExact) {
+        fprintf(out, "Changed display resolution from %zux%zu to %zux%zu\n",
+                original_width, original_height, width, height);
+    } else {
+        fprintf(out,
+                "Changed display resolution from %zux%zu @%f to %zux%zu"
+                " @%.1f\n",
+                original_width, original_height, original_refresh_rate,
+                width, height, refresh_rate);
+    }
+    if (!resolved->rearranged) {
+        return;
+    }
+    if (resolved->set_mirror && resolved->mirror) {
+        fprintf(out, "Mirroring display with ID %u\n", resolved->mirror);
+    } else if (resolved->set_mirror) {
+        fputs("Stopped mirroring\n", out);
+    }
+    if (resolved->set_origin) {
+        fprintf(out, "Moved display to %.0f,%.0f\n", resolved->origin.x,
+                resolved->origin.y);
+    }
+}
+
+// Replaces the mode chosen for a mirroring display with one that has the same
+// size in points and pixels as the mode of the display it mirrors, preferring
+// the same refresh rate.  Displays whose modes differ can only be mirrored in
+// software, which costs the mirrored display's GPU time every frame.  Keeps
+// the chosen mode, with a warning, if the display has no such mode.
+static void MatchMirroredMode(const struct Session * session,
+                              struct ResolvedMode * mirror,
+                              const struct ResolvedMode * resolved,
+                              uint32_t count) {
+    // The mirrored display's mode is either being set too, or its current.
+    CGDisplayModeRef target = NULL;
+    for (uint32_t i = 0; i < count && NULL == target; ++i) {
+        if (resolved[i].display == mirror->mirror) {
+            target = CGDisplayModeRetain(resolved[i].mode);
+        }
+    }
+    if (NULL == target) {
+        target = CGDisplayModeRetain(
+            GetCurrentMode(session, mirror->spec->mirror_index));
+    }
+    struct ModeInfo target_info;
+    GetModeInfo(target, &target_info);
+    CGDisplayModeRelease(target);
+
+    const uint32_t display_index = mirror->spec->display_index;
+    CFArrayRef modes = GetDisplayModes(session, display_index);
+    const struct ModeTable * table = GetModeTable(session, display_index, NULL);
+    if (NULL == modes || NULL == table) {
+        return;
+    }
+    long match = -1;
+    for (size_t i = 0; i < table->count; ++i) {
+        struct ModeInfo info;
+        GetModeTableRow(table, i, &info);
+        if (info.width != target_info.width ||
+            info.height != target_info.height ||
+            info.pixel_width != target_info.pixel_width ||
+            info.pixel_height != target_info.pixel_height) {
+            continue;
+        }
+        if (MatchesRefreshRate(target_info.refresh_rate, info.refresh_rate)) {
+            match = (long) i;
+            break;
+        }
+        if (match < 0) {
+            match = (long) i;
+        }
+    }
+    if (match < 0) {
+        fprintf(session->err,
+                "Display %u has no %ux%u mode to match the display it"
+                " mirrors; it may be mirrored in software\n",
+                display_index, target_info.width, target_info.height);
+        return;
+    }
+    CGDisplayModeRelease(mirror->mode);
+    mirror->mode = CGDisplayModeRetain(
+        (CGDisplayModeRef) CFArrayGetValueAtIndex(modes, match));
+}
+
+// Returns the scanout bandwidth of `mode' in bytes per second.
+static double GetModeBandwidth(CGDisplayModeRef mode) {
+    struct ModeInfo info;
+    GetModeInfo(mode, &info);
+    return GetScanoutBandwidth(info.pixel_width, info.pixel_height,
+                               info.refresh_rate);
+}
+
+// Returns the total bandwidth of the current modes of the active displays
+// that none of `specs' configure.
+static double GetUnchangedBandwidth(const struct Session * session,
+                                    const struct ModeSpec * specs,
+                                    uint32_t count) {
+    double total = 0.0;
+    for (uint32_t i = 0; i < session->state->num_displays; ++i) {
+        bool configured = false;
+        for (uint32_t j = 0; j < count; ++j) {
+            configured |= specs[j].display_index == i;
+        }
+        CGDisplayModeRef mode = GetCurrentMode(session, i);
+        if (!configured && mode) {
+            total += GetModeBandwidth(mode);
+        }
+    }
+    return total;
+}
+
+// Resolves the modes in `specs', first finding the displays they name.  Sets
+// `*num_resolved' to the number of modes resolved, which must be released
+// even if resolving a later mode fails.  With --hw-mirror, mirroring displays
+// are then given the mode of the display they mirror.
+static int ResolveModes(const struct Session * session,
+                        const struct ParsedArgs * parsed_args,
+                        struct ModeSpec * specs, uint32_t count,
+                        struct ResolvedMode * resolved,
+                        uint32_t * num_resolved) {
+    *num_resolved = 0;
+    int status = ResolveDisplayIndexes(session, specs, count);
+    double remaining_bandwidth = 0.0;
+    if (EXIT_SUCCESS == status && parsed_args->max_bandwidth != 0.0) {
+        remaining_bandwidth = parsed_args->max_bandwidth -
+            GetUnchangedBandwidth(session, specs, count);
+    }
+    while (EXIT_SUCCESS == status && *num_resolved < count) {
+        struct ModeSpec * const spec = &specs[*num_resolved];
+        spec->limit_bandwidth = parsed_args->max_bandwidth != 0.0;
+        spec->max_bandwidth = remaining_bandwidth;
+        status = ResolveMode(session, spec, &resolved[*num_resolved]);
+        if (EXIT_SUCCESS == status) {
+            remaining_bandwidth -=
+                GetModeBandwidth(resolved[(*num_resolved)++].mode);
+        }
+    }
+    if (EXIT_SUCCESS != status) {
+        return status;
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+        struct ResolvedMode * const r = &resolved[i];
+        if (parsed_args->hw_mirror && r->set_mirror && r->mirror) {
+            MatchMirroredMode(session, r, resolved, count);
+        }
+        const bool force = parsed_args->force;
+        r->unchanged = !force && CFEqual(r->mode, r->original_mode);
+        const bool moved = r->set_origin &&
+            (force || r->origin.x != r->original_origin.x ||
+             r->origin.y != r->original_origin.y);
+        r->rearranged = moved || (r->set_mirror &&
+            (force || r->mirror != r->original_mirror));
+    }
+    if (parsed_args->max_bandwidth != 0.0) {
+        // --hw-mirror may have picked modes without regard to the limit.
+        double total = GetUnchangedBandwidth(session, specs, count);
+        for (uint32_t i = 0; i < count; ++i) {
+            total += GetModeBandwidth(resolved[i].mode);
+        }
+        if (parsed_args->max_bandwidth < total) {
+            fprintf(session->err, "The modes need %.2f GB/s, more than"
+                    " --max-bandwidth\n", total / 1e9);
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+// Returns how long to wait for changed displays to settle.  Settling is
+// always measured for --timings, but only --wait makes timing out an error.
+static CFTimeInterval GetSettleTimeout(const struct Session * session,
+                                       const struct ParsedArgs * parsed_args) {
+    return parsed_args->wait_timeout
+        ? parsed_args->wait_timeout
+        : session->timings ? kSettleTimeout : 0;
+}
+
+static void PrintModeChanges(FILE * out, const struct ResolvedMode * resolved,
+                             uint32_t count) {
+    for (uint32_t i = 0; i < count; ++i) {
+        if (1 < count) {
+            fprintf(out, "Display %u: ", resolved[i].spec->display_index);
+        }
+        PrintModeChange(out, &resolved[i]);
+    }
+}
+
+// Prints the mode that would be set for `resolved' by a dry run, and how it
+// differs from the current configuration.
+static void PrintPlannedChange(FILE * out,
+                               const struct ResolvedMode * resolved) {
+    struct ModeInfo info;
+    GetModeInfo(resolved->mode, &info);
+    fprintf(out, "Display %u: ", resolved->spec->display_index);
+    PrintMode(out, &info, true);
+    if (resolved->unchanged) {
+        fputs(" (unchanged)\n", out);
+    } else {
+        struct ModeInfo original_info;
+        GetModeInfo(resolved->original_mode, &original_info);
+        fputs(" (would change from ", out);
+        PrintMode(out, &original_info, false);
+        fputs(")\n", out);
+    }
+    if (!resolved->rearranged) {
+        return;
+    }
+    if (resolved->set_mirror && resolved->mirror) {
+        fprintf(out, "Display %u: would mirror display with ID %u\n",
+                resolved->spec->display_index, resolved->mirror);
+    } else if (resolved->set_mirror) {
+        fprintf(out, "Display %u: would stop mirroring\n",
+                resolved->spec->display_index);
+    }
+    if (resolved->set_origin) {
+        fprintf(out, "Display %u: would move to %.0f,%.0f\n",
+                resolved->spec->display_index, resolved->origin.x,
+                resolved->origin.y);
+    }
+}
+
+// Sets the `count' modes in `requested' in a single configuration, using the
+// flags in `parsed_args', permanently for the user.  All the requested modes
+// are resolved before any display is reconfigured, and displays already in
+// the requested mode are left alone unless forced.  For --dry-run, stops once
+// every mode is resolved and prints what would be set instead.  Unless
+// `rejected' is NULL, sets it to whether the modes couldn't be resolved or
+// committed, as opposed to succeeding or failing to settle once set.
+static int ConfigureModes(const struct Session * session,
+                          const struct ParsedArgs * parsed_args,
+                          const struct ModeSpec * requested, uint32_t count,
+                          bool * rejected) {
+    struct ModeSpec specs[kMaxDisplays];
+    memcpy(specs, requested, count * sizeof(specs[0]));
+    struct ResolvedMode resolved[kMaxDisplays];
+    uint32_t num_resolved;
+    int status = ResolveModes(session, parsed_args, specs, count, resolved,
+                              &num_resolved);
+    bool committed = false;
+    if (rejected) {
+        *rejected = EXIT_SUCCESS != status;
+    }
+    if (EXIT_SUCCESS == status && parsed_args->dry_run) {
+        for (uint32_t i = 0; i < num_resolved; ++i) {
+            PrintPlannedChange(session->out, &resolved[i]);
+        }
+        ReleaseResolvedModes(resolved, num_resolved);
+        return EXIT_SUCCESS;
+    }
+    if (EXIT_SUCCESS == status) {
+        const struct CommitOptions options = GetCommitOptions(parsed_args);
+        status = ApplyModes(session, resolved, num_resolved, &options,
+                            GetSettleTimeout(session, parsed_args),
+                            0 < parsed_args->wait_timeout, &committed);
+        if (rejected) {
+            *rejected = !committed;
+        }
+    }
+    if (EXIT_SUCCESS == status) {
+        PrintModeChanges(session->out, resolved, num_resolved);
+    }
+    ReleaseResolvedModes(resolved, num_resolved);
+    return status;
+}
+
+// Sets the requested modes or, if they are rejected, each --fallback mode in
+// turn until one is set.  Every mode comes from the display's one mode table,
+// and each is tried once, so the attempts are bounded by the list.  A failed
+// configuration is cancelled before the next mode is tried.
+static int ConfigureMode(const struct Session * session,
+                         const struct ParsedArgs * parsed_args) {
+    bool rejected;
+    int status = ConfigureModes(session, parsed_args, parsed_args->modes,
+                                parsed_args->num_modes, &rejected);
+    for (uint32_t i = 0; rejected && i < parsed_args->num_fallbacks; ++i) {
+        const struct ModeSpec * const fallback = &parsed_args->fallbacks[i];
+        fprintf(session->err, "Falling back to %lux%lu\n", fallback->width,
+                fallback->height);
+        status = ConfigureModes(session, parsed_args, fallback, 1, &rejected);
+    }
+    return status;
+}
+
+extern char ** environ;
+
+// The command being run by RunChild, or 0.
+static volatile pid_t child_pid;
+
+// Passes a termination signal on to the command, so that displaymode outlives
+// it and can clean up.
+static void ForwardSignal(int signal_number) {
+    if (0 < child_pid) {
+        kill(child_pid, signal_number);
+    }
+}
+
+// Runs the `argc' words in `argv' as a command, searching PATH, and waits for
+// it to exit.  SIGTERM and SIGHUP are forwarded to the command while it runs.
+// Returns its exit status, or as a shell would, 128 plus the signal that
+// terminated it.
+static int RunChild(FILE * err, int argc, const char * const argv[]) {
+    char ** args = calloc((size_t) argc + 1, sizeof(*args));
+    if (NULL == args) {
+        fputs("Out of memory\n", err);
+        return EXIT_FAILURE;
+    }
+    memcpy(args, argv, (size_t) argc * sizeof(*args));
+
+    // Like system(3), leave interrupts from the terminal to the command, but
+    // don't let it inherit the ignored dispositions.
+    posix_spawnattr_t attributes;
+    posix_spawnattr_init(&attributes);
+    sigset_t defaults;
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGINT);
+    sigaddset(&defaults, SIGQUIT);
+    posix_spawnattr_setsigdefault(&attributes, &defaults);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGDEF);
+    void (* const old_sigint)(int) = signal(SIGINT, SIG_IGN);
+    void (* const old_sigquit)(int) = signal(SIGQUIT, SIG_IGN);
+
+    pid_t pid;
+    const int e = posix_spawnp(&pid, args[0], NULL, &attributes, args,
+                               environ);
+    posix_spawnattr_destroy(&attributes);
+    free(args);
+    int status = EXIT_FAILURE;
+    if (e) {
+        fprintf(err, "Could not run \"%s\": %s\n", argv[0], strerror(e));
+    } else {
+        child_pid = pid;
+        void (* const old_sigterm)(int) = signal(SIGTERM, ForwardSignal);
+        void (* const old_sighup)(int) = signal(SIGHUP, ForwardSignal);
+        int wait_status;
+        while (waitpid(pid, &wait_status, 0) < 0 && errno == EINTR) {
+        }
+        signal(SIGTERM, old_sigterm);
+        signal(SIGHUP, old_sighup);
+        child_pid = 0;
+        status = WIFEXITED(wait_status) ? WEXITSTATUS(wait_status)
+                                         : 128 + WTERMSIG(wait_status);
+    }
+    signal(SIGINT, old_sigint);
+    signal(SIGQUIT, old_sigquit);
+    return status;
+}
+
+// Sets the modes named in `parsed_args', runs the command and then restores
+// the modes that the displays had before, which are kept from resolving the
+// new modes rather than looked up again.  Returns the command's exit status,
+// or an error if restoring the modes fails.
+static int RunWithModes(const struct Session * session,
+                        const struct ParsedArgs * parsed_args) {
+    struct ModeSpec specs[kMaxDisplays];
+    memcpy(specs, parsed_args->modes,
+           parsed_args->num_modes * sizeof(specs[0]));
+    struct ResolvedMode resolved[kMaxDisplays];
+    uint32_t num_resolved;
+    int status = ResolveModes(session, parsed_args, specs,
+                              parsed_args->num_modes, resolved, &num_resolved);
+    const struct CommitOptions options = GetCommitOptions(parsed_args);
+    const CFTimeInterval settle_timeout =
+        GetSettleTimeout(session, parsed_args);
+    const bool require_settle = 0 < parsed_args->wait_timeout;
+    if (EXIT_SUCCESS == status) {
+        status = ApplyModes(session, resolved, num_resolved, &options,
+                            settle_timeout, require_settle, NULL);
+    }
+    if (EXIT_SUCCESS == status) {
+        PrintModeChanges(session->out, resolved, num_resolved);
+        fflush(session->out);
+        status = RunChild(session->err, parsed_args->command_argc,
+                          parsed_args->command);
+
+        struct ResolvedMode restore[kMaxDisplays];
+        for (uint32_t i = 0; i < num_resolved; ++i) {
+            restore[i] = GetRestoringMode(&resolved[i]);
+        }
+        const int restore_status = ApplyModes(
+            session, restore, num_resolved, &options, settle_timeout,
+            require_settle, NULL);
+        if (EXIT_SUCCESS == restore_status) {
+            PrintModeChanges(session->out, restore, num_resolved);
+        } else {
+            status = restore_status;
+        }
+    }
+    ReleaseResolvedModes(resolved, num_resolved);
+    return status;
+}
+
+// Releases the first `count' displays in `resolved'.
+static void ReleaseDisplays(const struct ResolvedMode * resolved,
+                            uint32_t count) {
+    for (uint32_t i = 0; i < count; ++i) {
+        CGDisplayRelease(resolved[i].display);
+    }
+}
+
+// Captures the displays named in `parsed_args', sets their modes in the same
+// configuration and runs the command while holding them.  The modes are set
+// for this process only, so that releasing the displays (or exiting) restores
+// the original modes.  Returns the command's exit status.
+static int CaptureAndRun(const struct Session * session,
+                         const struct ParsedArgs * parsed_args) {
+    struct ModeSpec specs[kMaxDisplays];
+    memcpy(specs, parsed_args->modes,
+           parsed_args->num_modes * sizeof(specs[0]));
+    struct ResolvedMode resolved[kMaxDisplays];
+    uint32_t num_resolved;
+    int status = ResolveModes(session, parsed_args, specs,
+                              parsed_args->num_modes, resolved, &num_resolved);
+    uint32_t num_captured = 0;
+    while (EXIT_SUCCESS == status && num_captured < num_resolved) {
+        CGError e = CGDisplayCapture(resolved[num_captured].display);
+        if (e) {
+            fprintf(session->err, "CGDisplayCapture CGError: %d\n", e);
+            status = e;
+        } else {
+            ++num_captured;
+        }
+    }
+    if (EXIT_SUCCESS == status) {
+        struct CommitOptions options = GetCommitOptions(parsed_args);
+        options.scope = kScopeApp;
+        status = ApplyModes(session, resolved, num_resolved, &options,
+                            GetSettleTimeout(session, parsed_args),
+                            0 < parsed_args->wait_timeout, NULL);
+    }
+    if (EXIT_SUCCESS == status) {
+        PrintModeChanges(session->out, resolved, num_resolved);
+        fflush(session->out);
+        status = RunChild(session->err, parsed_args->command_argc,
+                          parsed_args->command);
+    }
+    ReleaseDisplays(resolved, num_captured);
+    ReleaseResolvedModes(resolved, num_resolved);
+    return status;
+}
+
+// Reads the mode specifications in the profile at `path'.  Each line is a
+// display (an index or identity) followed by a mode, in the same form as for
+// "t"; blank lines and text following '#' are ignored.  Returns false if the
+// profile could not be read or is invalid.
+static bool ReadProfile(FILE * err, const char * path,
+                        const struct ParsedArgs * parsed_args,
+                        struct ModeSpec * specs, uint32_t * count) {
+    FILE * file = fopen(path, "r");
+    if (NULL == file) {
+        fprintf(err, "Could not open profile \"%s\": %s\n", path,
+                strerror(errno));
+        return false;
+    }
+    // ParseMode reports errors through the option.
+    struct ParsedArgs line_args = *parsed_args;
+    line_args.option = kOptionProfile;
+    bool valid = true;
+    *count = 0;
+    char line[kMaxCommandLength];
+    for (unsigned line_number = 1; valid && fgets(line, sizeof(line), file);
+         ++line_number) {
+        // A full buffer without a newline is only the start of a line,
+        // unless it ends the file.
+        const size_t length = strlen(line);
+        if (length == sizeof(line) - 1 && line[length - 1] != '\n') {
+            const int next = getc(file);
+            if (next != EOF) {
+                fprintf(err, "%s:%u: line too long\n", path, line_number);
+                valid = false;
+                break;
+            }
+        }
+        char * comment = strchr(line, '#');
+        if (comment) {
+            *comment = '\0';
+        }
+        const char * argv[kMaxCommandArgs];
+        const int argc = SplitCommandLine(line, argv, kMaxCommandArgs);
+        if (argc < 0) {
+            fprintf(err, "%s:%u: too many words\n", path, line_number);
+            valid = false;
+            break;
+        }
+        if (argc <= 1) {
+            continue;
+        }
+        if (*count == kMaxDisplays) {
+            fprintf(err, "%s:%u: too many displays; at most %u may be set\n",
+                    path, line_number, kMaxDisplays);
+            valid = false;
+            break;
+        }
+        struct ModeSpec * spec = &specs[(*count)++];
+        memset(spec, 0, sizeof(*spec));
+        ParseDisplay(err, argv[kProfileDisplayIndex], &spec->display,
+                     &spec->display_index, &line_args);
+        // The display comes first, so any word left over is an error.
+        const int next_index = ParseModeWords(err, argc, argv,
+                                              kProfileModeIndex, spec,
+                                              &line_args);
+        valid = line_args.option == kOptionProfile && next_index == argc;
+        if (!valid) {
+            fprintf(err, "%s:%u: invalid mode\n", path, line_number);
+        }
+    }
+    if (valid && ferror(file)) {
+        fprintf(err, "Could not read profile \"%s\"\n", path);
+        valid = false;
+    }
+    fclose(file);
+    if (valid && 0 == *count) {
+        fprintf(err, "Profile \"%s\" does not set any displays\n", path);
+        valid = false;
+    }
+    return valid;
+}
+
+// Sets every mode in the profile given by `parsed_args' in one configuration.
+static int ApplyProfile(const struct Session * session,
+                        const struct ParsedArgs * parsed_args) {
+    struct ModeSpec specs[kMaxDisplays];
+    uint32_t count;
+    if (!ReadProfile(session->err, parsed_args->profile_path, parsed_args,
+                     specs, &count)) {
+        return EXIT_FAILURE;
+    }
+    return ConfigureModes(session, parsed_args, specs, count, NULL);
+}
+
+// Writes a profile with the current mode of every active display to `path'.
+// Displays are named by identity unless another display has the same
+// identity.  Modes are not enumerated.
+static int SaveProfile(const struct Session * session, const char * path) {
+    CGError e;
+    if ((e = GetActiveDisplays(session))) {
+        return e;
+    }
+    const struct DisplayState * const state = session->state;
+    struct DisplayIdentity identities[kMaxDisplays];
+    for (uint32_t i = 0; i < state->num_displays; ++i) {
+        GetDisplayIdentity(state->displays[i], &identities[i]);
+    }
+
+    FILE * file = fopen(path, "w");
+    if (NULL == file) {
+        fprintf(session->err, "Could not create profile \"%s\": %s\n", path,
+                strerror(errno));
+        return EXIT_FAILURE;
+    }
+    fputs("# display width height [@refresh] [x<scale>]\n", file);
+    for (uint32_t i = 0; i < state->num_displays; ++i) {
+        CGDisplayModeRef mode = GetCurrentMode(session, i);
+        if (NULL == mode) {
+            continue;
+        }
+        struct ModeInfo info;
+        GetModeInfo(mode, &info);
+
+        bool unique = true;
+        for (uint32_t j = 0; j < state->num_displays; ++j) {
+            unique = unique && (i == j || !IsSameDisplayIdentity(
+                &identities[i], &identities[j]));
+        }
+        if (unique) {
+            fprintf(file, "%08x-%08x-%08x", identities[i].vendor,
+                    identities[i].model, identities[i].serial);
+        } else {
+            fprintf(file, "%u", i);
+        }
+        fprintf(file, " %u %u", info.width, info.height);
+        if (info.refresh_rate != 0.0) {
+            fprintf(file, " @%.3f", info.refresh_rate);
+        }
+        fprintf(file, " x%g\n", GetModeScale(info.width, info.pixel_width));
+    }
+    if (fclose(file)) {
+        fprintf(session->err, "Could not write profile \"%s\": %s\n",
+                path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+// Default number of times to repeat each benchmark.
+static const unsigned long kDefaultBenchmarkIterations = 20;
+
+// Names the OS release and hardware model in benchmark results.
+struct BenchmarkHost {
+    char os_version[32];
+    char model[64];
+};
+
+static void GetBenchmarkHost(struct BenchmarkHost * host) {
+    size_t size = sizeof(host->os_version);
+    if (sysctlbyname("kern.osproductversion", host->os_version, &size,
+                     NULL, 0)) {
+        strcpy(host->os_version, "unknown");
+    }
+    size = sizeof(host->model);
+    if (sysctlbyname("hw.model", host->model, &size, NULL, 0)) {
+        strcpy(host->model, "unknown");
+    }
+}
+
+static int CompareSamples(const void * a, const void * b) {
+    const uint64_t x = *(const uint64_t *) a;
+    const uint64_t y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+// Returns the nearest-rank percentile of the sorted samples, in milliseconds.
+static double GetPercentile(const uint64_t * sorted, size_t count,
+                            double percentile) {
+    size_t rank = (size_t) ceil(percentile / 100.0 * (double) count);
+    rank = rank ? rank - 1 : 0;
+    return (double) sorted[rank < count ? rank : count - 1] / 1e6;
+}
+
+// Prints a JSON object summarizing the samples for one benchmark.  Sorts the
+// samples in place.
+static void PrintBenchmark(FILE * out, const struct BenchmarkHost * host,
+                           const char * name, CGDirectDisplayID display,
+                           uint64_t * samples, size_t count) {
+    qsort(samples, count, sizeof(*samples), CompareSamples);
+    fprintf(out,
+            "{\"benchmark\":\"%s\",\"os\":\"%s\",\"model\":\"%s\","
+            "\"display\":%u,\"iterations\":%zu,\"min_ms\":%.4f,"
+            "\"p50_ms\":%.4f,\"p95_ms\":%.4f,\"p99_ms\":%.4f,"
+            "\"max_ms\":%.4f}\n",
+            name, host->os_version, host->model, display, count,
+            (double) samples[0] / 1e6,
+            GetPercentile(samples, count, 50),
+            GetPercentile(samples, count, 95),
+            GetPercentile(samples, count, 99),
+            (double) samples[count - 1] / 1e6);
+}
+
+// Measures round trips between the resolved mode and the display's original
+// mode.  Each sample includes waiting for the display to settle.  Returns
+// non-zero if a switch fails.
+static int BenchmarkSwitching(const struct Session * session,
+                              const struct ResolvedMode * target,
+                              const struct CommitOptions * options,
+                              uint64_t * samples, size_t count) {
+    const struct ResolvedMode original = GetRestoringMode(target);
+    const struct ResolvedMode * const steps[] = { target, &original };
+    for (size_t i = 0; i < count; ++i) {
+        const uint64_t start = GetMonotonicNanoseconds();
+        for (size_t j = 0; j < sizeof(steps) / sizeof(steps[0]); ++j) {
+            struct SettleWaiter waiter;
+            StartSettleWait(&waiter, steps[j], 1);
+            const CGError e = CommitModes(session, steps[j], 1, options);
+            if (kCGErrorSuccess == e) {
+                WaitForSettle(&waiter, kSettleTimeout);
+            }
+            StopSettleWait(&waiter);
+            if (e) {
+                return e;
+            }
+        }
+        samples[i] = GetMonotonicNanoseconds() - start;
+    }
+    return EXIT_SUCCESS;
+}
+
+// Repeatedly measures display list and mode queries, mode matching and (if a
+// mode was given) switching, printing one JSON line per benchmark.
+static int RunBenchmarks(const struct Session * session,
+                         const struct ParsedArgs * parsed_args) {
+    FILE * const out = session->out;
+    const size_t iterations = parsed_args->iterations
+        ? parsed_args->iterations : kDefaultBenchmarkIterations;
+    struct ModeSpec spec = { 0 };
+    if (parsed_args->num_modes) {
+        spec = parsed_args->modes[0];
+    }
+    CGDirectDisplayID display;
+    CGError e;
+    if ((e = ResolveDisplayIndexes(session, &spec, 1)) ||
+        (e = GetDisplayID(session, spec.display_index, &display))) {
+        return e;
+    }
+    uint64_t * samples = calloc(iterations, sizeof(*samples));
+    if (NULL == samples) {
+        fputs("Out of memory\n", session->err);
+        return EXIT_FAILURE;
+    }
+    struct BenchmarkHost host;
+    GetBenchmarkHost(&host);
+
+    for (size_t i = 0; i < iterations; ++i) {
+        CGDirectDisplayID displays[kMaxDisplays];
+        uint32_t num_displays;
+        const uint64_t start = GetMonotonicNanoseconds();
+        CGGetActiveDisplayList(kMaxDisplays, displays, &num_displays);
+        samples[i] = GetMonotonicNanoseconds() - start;
+    }
+    PrintBenchmark(out, &host, "display-list", display, samples, iterations);
+
+    struct {
+        const char * name;
+        CFDictionaryRef options;
+    } const copies[] = {
+        { "copy-modes", NULL },
+        { "copy-modes-low-resolution", GetLowResolutionModeOptions() },
+    };
+    for (size_t c = 0; c < sizeof(copies) / sizeof(copies[0]); ++c) {
+        for (size_t i = 0; i < iterations; ++i) {
+            const uint64_t start = GetMonotonicNanoseconds();
+            CFArrayRef modes =
+                CGDisplayCopyAllDisplayModes(display, copies[c].options);
+            samples[i] = GetMonotonicNanoseconds() - start;
+            if (modes) {
+                CFRelease(modes);
+            }
+        }
+        PrintBenchmark(out, &host, copies[c].name, display, samples,
+                       iterations);
+    }
+
+    CFArrayRef modes = GetDisplayModes(session, spec.display_index);
+    const struct ModeTable * table =
+        GetModeTable(session, spec.display_index, NULL);
+    if (NULL == modes || NULL == table) {
+        fprintf(session->err, "Could not get modes for display %u\n",
+                spec.display_index);
+        free(samples);
+        return kCGErrorFailure;
+    }
+    for (size_t i = 0; i < iterations; ++i) {
+        const uint64_t start = GetMonotonicNanoseconds();
+        FreeModeTable(CreateModeTable(modes));
+        samples[i] = GetMonotonicNanoseconds() - start;
+    }
+    PrintBenchmark(out, &host, "mode-table", display, samples, iterations);
+
+    // Without a requested mode, match the current resolution.
+    struct ModeSpec match_spec = spec;
+    if (0 == parsed_args->num_modes) {
+        CGDisplayModeRef current_mode = CGDisplayCopyDisplayMode(display);
+        match_spec.width = CGDisplayModeGetWidth(current_mode);
+        match_spec.height = CGDisplayModeGetHeight(current_mode);
+        CGDisplayModeRelease(current_mode);
+    }
+    for (size_t i = 0; i < iterations; ++i) {
+        const uint64_t start = GetMonotonicNanoseconds();
+        CGDisplayModeRef mode = GetModeMatching(&match_spec, table, modes);
+        samples[i] = GetMonotonicNanoseconds() - start;
+        CGDisplayModeRelease(mode);
+    }
+    PrintBenchmark(out, &host, "matching", display, samples, iterations);
+
+    int status = EXIT_SUCCESS;
+    struct ResolvedMode target;
+    if (parsed_args->num_modes &&
+        EXIT_SUCCESS == (status = ResolveMode(session, &spec, &target))) {
+        if (CFEqual(target.mode, target.original_mode)) {
+            fputs("Benchmark mode must differ from the current mode\n",
+                  session->err);
+            status = EXIT_FAILURE;
+        } else {
+            // Saving preferences would add to the timings, and would keep
+            // the benchmark mode if interrupted, so by default the changes
+            // last only until displaymode exits.
+            struct CommitOptions options = GetCommitOptions(parsed_args);
+            if (kScopeDefault == options.scope) {
+                options.scope = kScopeApp;
+            }
+            status = BenchmarkSwitching(session, &target, &options, samples,
+                                        iterations);
+            if (EXIT_SUCCESS == status) {
+                PrintBenchmark(out, &host, "switch-round-trip", display,
+                               samples, iterations);
+            }
+        }
+        ReleaseResolvedModes(&target, 1);
+    }
+    free(samples);
+    return status;
+}
+
+// Kinds of display change reported by "w".
+enum WatchEvent {
+    kWatchAdded,
+    kWatchRemoved,
+    kWatchMode,
+    kWatchMirror,
+};
+
+static const char * const kWatchEventNames[] = {
+    [kWatchAdded] = "added",
+    [kWatchRemoved] = "removed",
+    [kWatchMode] = "mode",
+    [kWatchMirror] = "mirror",
+};
+
+// The displays known to "w", with the last mode reported for each.
+struct Watch {
+    const struct Session * session;
+    const struct ParsedArgs * parsed_args;
+    uint32_t count;
+    CGDirectDisplayID displays[kMaxDisplays];
+    struct ModeInfo modes[kMaxDisplays];
+};
+
+// Returns the index of `info' in the display's mode list (as listed by "d"),
+// or -1 if it is not listed.  Only this display's modes are enumerated.
+static long FindModeRow(struct Watch * watch, uint32_t display_index,
+                        const struct ModeInfo * info) {
+    const struct ModeTable * table = GetModeTable(
+        watch->session, display_index, watch->parsed_args->cache_dir);
+    if (NULL == table) {
+        return -1;
+    }
+    for (size_t i = FindResolution(table, info->width, info->height);
+         i < table->count; ++i) {
+        const uint32_t row = table->by_resolution[i];
+        struct ModeInfo row_info;
+        GetModeTableRow(table, row, &row_info);
+        if (row_info.width != info->width || row_info.height != info->height) {
+            break;
+        }
+        if (IsSameModeInfo(&row_info, info)) {
+            return row;
+        }
+    }
+    return -1;
+}
+
+// Prints a single change, with the display's mode unless it was removed.
+static void PrintWatchEvent(struct Watch * watch, enum WatchEvent event,
+                            CGDirectDisplayID display, int display_index,
+                            const struct ModeInfo * info) {
+    FILE * const out = watch->session->out;
+    const enum OutputFormat format = watch->parsed_args->format;
+    const CGDirectDisplayID mirrors = CGDisplayMirrorsDisplay(display);
+    const long row = (event != kWatchRemoved && 0 <= display_index)
+        ? FindModeRow(watch, (uint32_t) display_index, info) : -1;
+    if (format == kFormatJSON) {
+        fprintf(out, "{\"event\":\"%s\",\"display_id\":%u",
+                kWatchEventNames[event], display);
+        if (event != kWatchRemoved) {
+            char index[24] = "null";
+            char mode_index[24] = "null";
+            if (0 <= display_index) {
+                snprintf(index, sizeof(index), "%d", display_index);
+            }
+            if (0 <= row) {
+                snprintf(mode_index, sizeof(mode_index), "%ld", row);
+            }
+            fprintf(out,
+                    ",\"display\":%s,\"index\":%s,\"width\":%u,"
+                    "\"height\":%u,\"pixel_width\":%u,"
+                    "\"pixel_height\":%u,\"refresh_rate\":%.3f,"
+                    "\"mirrors\":%u",
+                    index, mode_index, info->width, info->height,
+                    info->pixel_width, info->pixel_height,
+                    info->refresh_rate, mirrors);
+        }
+        fputs("}\n", out);
+    } else if (format == kFormatTSV) {
+        if (event == kWatchRemoved) {
+            fprintf(out, "%s\t%u\n", kWatchEventNames[event], display);
+        } else {
+            fprintf(out, "%s\t%u\t%d\t%ld\t%u\t%u\t%u\t%u\t%.3f\t%u\n",
+                    kWatchEventNames[event], display, display_index, row,
+                    info->width, info->height, info->pixel_width,
+                    info->pixel_height, info->refresh_rate, mirrors);
+        }
+    } else if (event == kWatchRemoved) {
+        fprintf(out, "removed display (id %u)\n", display);
+    } else {
+        fprintf(out, "%s display %d (id %u): ", kWatchEventNames[event],
+                display_index, display);
+        PrintMode(out, info, false);
+        if (mirrors != kCGNullDirectDisplay) {
+            fprintf(out, " mirrors %u", mirrors);
+        }
+        fputs("\n", out);
+    }
+    fflush(out);
+}
+
+// Returns the position of `display' in the watch, or -1.
+static int FindWatchedDisplay(const struct Watch * watch,
+                              CGDirectDisplayID display) {
+    for (uint32_t i = 0; i < watch->count; ++i) {
+        if (watch->displays[i] == display) {
+            return (int) i;
+        }
+    }
+    return -1;
+}
+
+// Returns a new reference to the current mode of `display', taken from the
+// session's snapshot if the display is active.
+static CGDisplayModeRef CopyCurrentMode(const struct Session * session,
+                                        CGDirectDisplayID display) {
+    const int display_index = FindDisplayIndex(session->state, display);
+    return 0 <= display_index
+        ? CGDisplayModeRetain(GetCurrentMode(session, (uint32_t) display_index))
+        : CGDisplayCopyDisplayMode(display);
+}
+
+// Starts watching `display', reporting it as added.
+static void AddWatchedDisplay(struct Watch * watch,
+                              CGDirectDisplayID display, int display_index) {
+    if (watch->count == kMaxDisplays) {
+        return;
+    }
+    const uint32_t i = watch->count++;
+    watch->displays[i] = display;
+    CGDisplayModeRef mode = CopyCurrentMode(watch->session, display);
+    GetModeInfo(mode, &watch->modes[i]);
+    CGDisplayModeRelease(mode);
+    PrintWatchEvent(watch, kWatchAdded, display, display_index,
+                    &watch->modes[i]);
+}
+
+// Reports the changes described by a reconfiguration notification.
+static void ReportDisplayChange(CGDirectDisplayID display,
+                                CGDisplayChangeSummaryFlags flags,
+                                void * user_info) {
+    static const CGDisplayChangeSummaryFlags kDisplaySetChangedFlags =
+        kCGDisplayAddFlag | kCGDisplayRemoveFlag |
+        kCGDisplayEnabledFlag | kCGDisplayDisabledFlag |
+        kCGDisplayMirrorFlag | kCGDisplayUnMirrorFlag;
+    static const CGDisplayChangeSummaryFlags kMirrorFlags =
+        kCGDisplayMirrorFlag | kCGDisplayUnMirrorFlag;
+    if (flags & kCGDisplayBeginConfigurationFlag) {
+        return;
+    }
+    struct Watch * const watch = user_info;
+    struct DisplayState * const state = watch->session->state;
+    if (flags & kDisplaySetChangedFlags) {
+        RefreshActiveDisplays(watch->session);
+    }
+    const int display_index = FindDisplayIndex(state, display);
+    if (0 <= display_index) {
+        CGDisplayModeRelease(state->current_modes[display_index]);
+        state->current_modes[display_index] = NULL;
+    }
+    if (0 <= display_index && (flags & kMirrorFlags)) {
+        // Mirroring can change which modes are available.
+        InvalidateDisplayModes(state, (uint32_t) display_index);
+    }
+
+    int watched = FindWatchedDisplay(watch, display);
+    if (flags & (kCGDisplayRemoveFlag | kCGDisplayDisabledFlag)) {
+        if (0 <= watched) {
+            PrintWatchEvent(watch, kWatchRemoved, display, -1, NULL);
+            --watch->count;
+            watch->displays[watched] = watch->displays[watch->count];
+            watch->modes[watched] = watch->modes[watch->count];
+        }
+        return;
+    }
+    if (watched < 0) {
+        AddWatchedDisplay(watch, display, display_index);
+        return;
+    }
+
+    struct ModeInfo info;
+    CGDisplayModeRef mode = CopyCurrentMode(watch->session, display);
+    if (NULL == mode) {
+        return;
+    }
+    GetModeInfo(mode, &info);
+    CGDisplayModeRelease(mode);
+    if (flags & kMirrorFlags) {
+        PrintWatchEvent(watch, kWatchMirror, display, display_index, &info);
+    }
+    if (!IsSameModeInfo(&info, &watch->modes[watched])) {
+        watch->modes[watched] = info;
+        PrintWatchEvent(watch, kWatchMode, display, display_index, &info);
+    }
+}
+
+// Reports each active display as added, then reports display changes as
+// they happen, until killed.  Nothing is polled: the process sleeps in the
+// run loop until CoreGraphics delivers a reconfiguration notification.
+static int RunWatch(const struct Session * session,
+                    const struct ParsedArgs * parsed_args) {
+    CGError e;
+    if ((e = GetActiveDisplays(session))) {
+        return e;
+    }
+    struct Watch watch = {
+        .session = session,
+        .parsed_args = parsed_args,
+    };
+    const struct DisplayState * const state = session->state;
+    for (uint32_t i = 0; i < state->num_displays; ++i) {
+        AddWatchedDisplay(&watch, state->displays[i], (int) i);
+    }
+
+    if ((e = CGDisplayRegisterReconfigurationCallback(ReportDisplayChange,
+                                                      &watch))) {
+        fprintf(session->err,
+                "CGDisplayRegisterReconfigurationCallback CGError: %d\n", e);
+        return e;
+    }
+    CFRunLoopRun();
+    CGDisplayRemoveReconfigurationCallback(ReportDisplayChange, &watch);
+    return EXIT_SUCCESS;
+}
+
+static int RunServer(const struct ParsedArgs * parsed_args);
+static int RunPipeline(const struct Session * session);
+static int RunFleet(const struct Session * session,
+                    const struct ParsedArgs * parsed_args);
+
+// Executes the option described by `parsed_args' and returns its exit
+// status.
+static int RunOption(const struct Session * session,
+                     const struct ParsedArgs * parsed_args) {
+    FILE * const err = session->err;
+    switch (parsed_args->option) {
         case kOptionMissing:
-            fputs("Missing option; server mode is not supported\n\n", stderr);
-            ShowUsage();
+            fputs("Missing option\n\n", err);
+            ShowUsage(err);
+            break;
+
+        case kOptionInvalid:
+            fprintf(err, "Invalid option: '%s'\n\n",
+                    parsed_args->literal_option);
+            ShowUsage(err);
+            break;
+
+        case kOptionInvalidMode:
+            fputs("Invalid mode\n", err);
+            break;
+
+        case kOptionConfigureMode:
+            return ConfigureMode(session, parsed_args);
+
+        case kOptionBenchmark:
+            return RunBenchmarks(session, parsed_args);
+
+        case kOptionCapture:
+            return parsed_args->dry_run
+                ? ConfigureMode(session, parsed_args)
+                : CaptureAndRun(session, parsed_args);
+
+        case kOptionRun:
+            return parsed_args->dry_run
+                ? ConfigureMode(session, parsed_args)
+                : RunWithModes(session, parsed_args);
+
+        case kOptionProfile:
+            return parsed_args->save_profile
+                ? SaveProfile(session, parsed_args->profile_path)
+                : ApplyProfile(session, parsed_args);
+
+        case kOptionHelp:
+            ShowUsage(session->out);
+            return EXIT_SUCCESS;
+
+        case kOptionServer:
+            return RunServer(parsed_args);
+
+        case kOptionPipeline:
+            return RunPipeline(session);
+
+        case kOptionFleet:
+            return RunFleet(session, parsed_args);
+
+        case kOptionSupportedModes:
+            return PrintModesForDisplays(session, parsed_args);
+
+        case kOptionCurrentMode:
+            return PrintCurrentModes(session, parsed_args);
+
+        case kOptionWatch:
+            return RunWatch(session, parsed_args);
+
+        case kOptionVersion:
+            fprintf(session->out, "%s\nCopyright 2019-2023 Dean Scarff\n",
+                    kProgramVersion);
+            return EXIT_SUCCESS;
+
+        default:
+            break;
+    }
+    return EXIT_FAILURE;
+}
+
+// Maximum number of simultaneous server connections.
+enum { kMaxClients = 16 };
+
+// Executes the command described by `parsed_args' and returns its exit
+// status, reporting its timings if requested.  Unless `rejected' is NULL,
+// sets it to whether the command failed before completing any display
+// configuration, so that running it again would change the same displays.
+static int RunCommand(const struct Session * session,
+                      const struct ParsedArgs * parsed_args,
+                      bool * rejected) {
+    bool reconfigured = false;
+    struct Session command_session = *session;
+    command_session.reconfigured = &reconfigured;
+    command_session.mode_options =
+        parsed_args->low_resolution ? GetLowResolutionModeOptions() : NULL;
+    SelectModeOptions(session->state, command_session.mode_options);
+    // Modes may have been changed by something else since the last command.
+    InvalidateCurrentModes(session->state);
+    struct Timings timings = { 0 };
+    if (parsed_args->timings) {
+        command_session.timings = &timings;
+    }
+    const int status = RunOption(&command_session, parsed_args);
+    if (parsed_args->timings) {
+        PrintTimings(session->err, &timings);
+    }
+    if (rejected) {
+        *rejected = EXIT_SUCCESS != status && !reconfigured;
+    }
+    return status;
+}
+
+// Maximum length of the shared secret for TCP connections, including the
+// terminating NUL.
+enum { kMaxTokenLength = 256 };
+
+// Number of random bytes a TCP client must prove it can authenticate.
+enum { kChallengeLength = 16 };
+
+// How long a TCP client has to answer the challenge, in nanoseconds, so that
+// idle connections can't take every client slot.
+static const uint64_t kAuthTimeout = 5000000000u;
+
+// Length of a hex-encoded challenge or authentication response, including the
+// terminating NUL.
+enum {
+    kChallengeHexLength = 2 * kChallengeLength + 1,
+    kAuthResponseHexLength = 2 * CC_SHA256_DIGEST_LENGTH + 1,
+};
+
+// Port used by "f" for hosts listed without one.
+static const char kDefaultFleetPort[] = "7283";
+
+// Prefix of "s" sockets that are TCP addresses rather than paths.
+static const char kTCPSocketPrefix[] = "tcp:";
+
+// Reads the shared secret from the first line of the file at `path'.  Since
+// the secret grants control of the displays, the file must not be accessible
+// to other users.  Returns false on failure.
+static bool ReadToken(FILE * err, const char * path,
+                      char token[kMaxTokenLength]) {
+    if (NULL == path) {
+        fputs("A --token-file is required\n", err);
+        return false;
+    }
+    FILE * file = fopen(path, "r");
+    if (NULL == file) {
+        fprintf(err, "Could not open token file \"%s\": %s\n", path,
+                strerror(errno));
+        return false;
+    }
+    struct stat st;
+    bool valid = false;
+    if (0 != fstat(fileno(file), &st) || (st.st_mode & 077)) {
+        fprintf(err, "Token file \"%s\" must not be accessible to other"
+                " users\n", path);
+    } else {
+        if (fgets(token, kMaxTokenLength, file)) {
+            token[strcspn(token, "\r\n")] = '\0';
+            valid = token[0] != '\0';
+        }
+        if (!valid) {
+            fprintf(err, "Token file \"%s\" is empty\n", path);
+        }
+    }
+    fclose(file);
+    return valid;
+}
+
+static void FormatHex(const unsigned char * bytes, size_t count, char * hex) {
+    for (size_t i = 0; i < count; ++i) {
+        snprintf(&hex[2 * i], 3, "%02x", bytes[i]);
+    }
+    hex[2 * count] = '\0';
+}
+
+// Writes the response that proves knowledge of `token' for `challenge': the
+// hex HMAC-SHA256 of the challenge keyed by the token.  The token itself is
+// never sent.
+static void GetAuthResponse(const char * token, const char * challenge,
+                            char response[kAuthResponseHexLength]) {
+    unsigned char digest[CC_SHA256_DIGEST_LENGTH];
+    CCHmac(kCCHmacAlgSHA256, token, strlen(token), challenge,
+           strlen(challenge), digest);
+    FormatHex(digest, sizeof(digest), response);
+}
+
+// Compares two strings in time that doesn't depend on where they differ.
+static bool IsSameSecret(const char * a, const char * b) {
+    const size_t length = strlen(a);
+    if (length != strlen(b)) {
+        return false;
+    }
+    unsigned char difference = 0;
+    for (size_t i = 0; i < length; ++i) {
+        difference |= (unsigned char) (a[i] ^ b[i]);
+    }
+    return 0 == difference;
+}
+
+// A connection to the server, with its partially-read command line.
+struct ServerClient {
+    int fd;  // -1 if this slot is unused
+    FILE * stream;
+    // Whether the client may run commands.  TCP clients must first answer a
+    // challenge with "auth <response>".
+    bool authenticated;
+    char challenge[kChallengeHexLength];
+    uint64_t accepted_at;  // GetMonotonicNanoseconds when accepted
+    // Whether the rest of an overlong line is being dropped.
+    bool discarding;
+    size_t length;
+    char line[kMaxCommandLength];
+};
+
+struct Server {
+    int listener;
+    enum ConfigureScope scope;  // for commands that do not give one
+    bool authenticate;  // whether clients must prove they know `token'
+    char token[kMaxTokenLength];
+    struct DisplayState state;
+    struct ServerClient clients[kMaxClients];
+};
+
+// Returns true if `option' may be run by the server or a pipeline.  Options
+// that serve, watch or run other commands would block the next command or
+// share its input, so they can only be run on their own.
+static bool IsRunnableCommand(enum Option option) {
+    return option != kOptionServer &&
+           option != kOptionWatch &&
+           option != kOptionCapture &&
+           option != kOptionFleet &&
+           option != kOptionRun &&
+           option != kOptionPipeline;
+}
+
+// Parses and executes a single command line from a client, then writes a
+// status line ("ok" or "error <status>") terminating the response.
+static void ExecuteClientCommand(struct Server * server,
+                                 struct ServerClient * client, char * line) {
+    const char * argv[kMaxCommandArgs];
+    const int argc = SplitCommandLine(line, argv, kMaxCommandArgs);
+    if (argc < 0) {
+        fputs("Command has too many words\nerror 1\n", client->stream);
+        fflush(client->stream);
+        return;
+    }
+    if (argc <= 1) {
+        // Ignore blank lines.
+        return;
+    }
+
+    // Deliver any reconfiguration callbacks queued while waiting for input,
+    // so that stale modes are discarded before the command runs.
+    CFRunLoopRunInMode(kCFRunLoopDefaultMode, 0, false);
+
+    const struct Session session = {
+        .out = client->stream,
+        .err = client->stream,
+        .state = &server->state,
+    };
+    struct ParsedArgs parsed_args = ParseArgs(client->stream, argc, argv);
+    if (parsed_args.scope == kScopeDefault) {
+        parsed_args.scope = server->scope;
+    }
+    int status;
+    if (!IsRunnableCommand(parsed_args.option)) {
+        fprintf(client->stream, "Option '%c' is not supported by the server\n",
+                parsed_args.option);
+        status = EXIT_FAILURE;
+    } else {
+        status = RunCommand(&session, &parsed_args, NULL);
+    }
+    if (status == EXIT_SUCCESS) {
+        fputs("ok\n", client->stream);
+    } else {
+        fprintf(client->stream, "error %d\n", status);
+    }
+    fflush(client->stream);
+}
+
+static void CloseClient(struct ServerClient * client) {
+    fclose(client->stream);
+    close(client->fd);
+    client->fd = -1;
+    client->stream = NULL;
+    client->length = 0;
+}
+
+// Checks a client's "auth <response>" line against its challenge.
+static bool AuthenticateClient(const struct Server * server,
+                               struct ServerClient * client,
+                               const char * line) {
+    static const char kAuthPrefix[] = "auth ";
+    const size_t prefix_length = strlen(kAuthPrefix);
+    if (0 != strncmp(line, kAuthPrefix, prefix_length)) {
+        return false;
+    }
+    char expected[kAuthResponseHexLength];
+    GetAuthResponse(server->token, client->challenge, expected);
+    client->authenticated = IsSameSecret(line + prefix_length, expected);
+    return client->authenticated;
+}
+
+// Reads from a client connection and executes each complete line.  Closes
+// the connection at end-of-file.
+static void ReadClient(struct Server * server, struct ServerClient * client) {
+    const size_t capacity = sizeof(client->line) - client->length;
+    const ssize_t n =
+        read(client->fd, &client->line[client->length], capacity - 1);
+    if (n <= 0) {
+        CloseClient(client);
+        return;
+    }
+    client->length += (size_t) n;
+    client->line[client->length] = '\0';
+
+    char * start = client->line;
+    char * newline;
+    if (client->discarding) {
+        // Drop the rest of the overlong line, up to and including its newline.
+        if (NULL == (newline = strchr(start, '\n'))) {
+            client->length = 0;
+            return;
+        }
+        client->discarding = false;
+        start = newline + 1;
+    }
+    while ((newline = strchr(start, '\n'))) {
+        *newline = '\0';
+        if (client->authenticated) {
+            ExecuteClientCommand(server, client, start);
+        } else if (!AuthenticateClient(server, client, start)) {
+            fputs("error auth\n", client->stream);
+            CloseClient(client);
+            return;
+        }
+        start = newline + 1;
+    }
+    client->length -= (size_t) (start - client->line);
+    if (client->length + 1 == sizeof(client->line)) {
+        fputs("Command too long\nerror 1\n", client->stream);
+        fflush(client->stream);
+        client->discarding = true;
+        client->length = 0;
+    }
+    memmove(client->line, start, client->length);
+}
+
+// Accepts a new client connection into a free slot.
+static void AcceptClient(struct Server * server) {
+    const int fd = accept(server->listener, NULL, NULL);
+    if (fd < 0) {
+        fprintf(stderr, "Error accepting client: %s\n", strerror(errno));
+        return;
+    }
+    struct ServerClient * client = NULL;
+    for (size_t i = 0; i < kMaxClients && NULL == client; ++i) {
+        if (server->clients[i].fd < 0) {
+            client = &server->clients[i];
+        }
+    }
+    const int stream_fd = client ? dup(fd) : -1;
+    if (NULL == client || stream_fd < 0 ||
+        NULL == (client->stream = fdopen(stream_fd, "w"))) {
+        fputs("Error accepting client: too many clients\n", stderr);
+        if (stream_fd >= 0) {
+            close(stream_fd);
+        }
+        close(fd);
+        return;
+    }
+    client->fd = fd;
+    client->length = 0;
+    client->discarding = false;
+    client->accepted_at = GetMonotonicNanoseconds();
+    client->authenticated = !server->authenticate;
+    if (!client->authenticated) {
+        unsigned char challenge[kChallengeLength];
+        arc4random_buf(challenge, sizeof(challenge));
+        FormatHex(challenge, sizeof(challenge), client->challenge);
+        fprintf(client->stream, "challenge %s\n", client->challenge);
+        fflush(client->stream);
+    }
+}
+
+// Discards cached mode lists when the set of displays changes.  Mode changes
+// alone don't alter the available modes, so they leave the cache intact.
+static void InvalidateOnReconfiguration(CGDirectDisplayID display,
+                                        CGDisplayChangeSummaryFlags flags,
+                                        void * user_info) {
+    static const CGDisplayChangeSummaryFlags kDisplaySetChangedFlags =
+        kCGDisplayAddFlag | kCGDisplayRemoveFlag |
+        kCGDisplayEnabledFlag | kCGDisplayDisabledFlag |
+        kCGDisplayMirrorFlag | kCGDisplayUnMirrorFlag;
+    if (flags & kDisplaySetChangedFlags) {
+        InvalidateDisplayState(user_info);
+    }
+}
+
+// Closes the clients that haven't authenticated within kAuthTimeout.  Returns
+// the poll timeout in milliseconds until the next client would expire, or -1
+// if no client is waiting to authenticate.
+static int ExpireUnauthenticatedClients(struct Server * server) {
+    const uint64_t now = GetMonotonicNanoseconds();
+    uint64_t next_expiry = UINT64_MAX;
+    for (size_t i = 0; i < kMaxClients; ++i) {
+        struct ServerClient * const client = &server->clients[i];
+        if (client->fd < 0 || client->authenticated) {
+            continue;
+        }
+        const uint64_t expiry = client->accepted_at + kAuthTimeout;
+        if (expiry <= now) {
+            fputs("error auth\n", client->stream);
+            CloseClient(client);
+        } else if (expiry < next_expiry) {
+            next_expiry = expiry;
+        }
+    }
+    if (next_expiry == UINT64_MAX) {
+        return -1;
+    }
+    // Round up so that the client has expired when poll returns.
+    return (int) ((next_expiry - now + 999999) / 1000000);
+}
+
+// Waits for and services connections to the server until an error occurs.
+//
+// The server polls its sockets directly rather than scheduling them on the
+// run loop, so that commands which run the run loop themselves (e.g. to wait
+// for displays to settle) can't re-enter the server.
+static int ServeClients(struct Server * server) {
+    for (;;) {
+        const int timeout = ExpireUnauthenticatedClients(server);
+        struct pollfd fds[1 + kMaxClients];
+        struct ServerClient * polled[1 + kMaxClients];
+        nfds_t num_fds = 0;
+        fds[num_fds++] = (struct pollfd) {
+            .fd = server->listener, .events = POLLIN,
+        };
+        for (size_t i = 0; i < kMaxClients; ++i) {
+            if (server->clients[i].fd >= 0) {
+                polled[num_fds] = &server->clients[i];
+                fds[num_fds++] = (struct pollfd) {
+                    .fd = server->clients[i].fd, .events = POLLIN,
+                };
+            }
+        }
+
+        if (poll(fds, num_fds, timeout) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Error polling sockets: %s\n", strerror(errno));
+            return EXIT_FAILURE;
+        }
+        for (nfds_t i = 1; i < num_fds; ++i) {
+            if (fds[i].revents) {
+                ReadClient(server, polled[i]);
+            }
+        }
+        if (fds[0].revents & POLLIN) {
+            AcceptClient(server);
+        }
+    }
+}
+
+// Listens on the Unix domain socket at `socket_path', replacing a stale socket
+// left by a previous server.  Returns the listening socket, or -1 on failure.
+static int ListenOnUnixSocket(const char * socket_path) {
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path too long: \"%s\"\n", socket_path);
+        return -1;
+    }
+    strcpy(address.sun_path, socket_path);
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        fprintf(stderr, "Error creating socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    // Replace a stale socket left by a previous server, but not the socket of
+    // one that is still running.
+    struct stat st;
+    if (0 == lstat(socket_path, &st) && S_ISSOCK(st.st_mode)) {
+        const int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        const bool refused =
+            0 <= probe && connect(probe, (const struct sockaddr *) &address,
+                                  sizeof(address)) < 0 &&
+            errno == ECONNREFUSED;
+        if (0 <= probe) {
+            close(probe);
+        }
+        if (!refused) {
+            fprintf(stderr, "Socket \"%s\" is already in use\n",
+                    socket_path);
+            close(fd);
+            return -1;
+        }
+        unlink(socket_path);
+    }
+    // Only the current user may send commands.
+    const mode_t old_umask = umask(077);
+    const int bound = bind(fd, (const struct sockaddr *) &address,
+                           sizeof(address));
+    umask(old_umask);
+    if (bound < 0 || listen(fd, SOMAXCONN) < 0) {
+        fprintf(stderr, "Error listening on \"%s\": %s\n",
+                socket_path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Splits "[host:]port" into its parts, using `default_port' if there is no
+// port.  Returns false if the host is too long.
+static bool SplitHostPort(const char * address, const char * default_port,
+                          char host[NI_MAXHOST], const char ** port) {
+    const char * colon = strrchr(address, ':');
+    const size_t host_length = colon ? (size_t) (colon - address)
+                                     : strlen(address);
+    if (NI_MAXHOST <= host_length) {
+        return false;
+    }
+    memcpy(host, address, host_length);
+    host[host_length] = '\0';
+    *port = colon ? colon + 1 : default_port;
+    return true;
+}
+
+// Listens for TCP connections on "[address:]port", or on every address if
+// none is given.  Returns the listening socket, or -1 on failure.
+static int ListenOnTCPSocket(const char * spec) {
+    char host[NI_MAXHOST] = "";
+    const char * port = spec;
+    if (strchr(spec, ':') && !SplitHostPort(spec, NULL, host, &port)) {
+        fprintf(stderr, "Address too long: \"%s\"\n", spec);
+        return -1;
+    }
+    const struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+        .ai_flags = AI_PASSIVE,
+    };
+    struct addrinfo * addresses;
+    const int e = getaddrinfo(host[0] ? host : NULL, port, &hints, &addresses);
+    if (e) {
+        fprintf(stderr, "Error resolving \"%s\": %s\n", spec,
+                gai_strerror(e));
+        return -1;
+    }
+    int fd = -1;
+    int error = 0;
+    for (struct addrinfo * a = addresses; a && fd < 0; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd < 0) {
+            error = errno;
+            continue;
+        }
+        const int reuse = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        if (bind(fd, a->ai_addr, a->ai_addrlen) < 0 ||
+            listen(fd, SOMAXCONN) < 0) {
+            error = errno;
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    if (fd < 0) {
+        fprintf(stderr, "Error listening on \"%s\": %s\n", spec,
+                strerror(error));
+    }
+    return fd;
+}
+
+// Listens on the socket given by `parsed_args' and executes commands from
+// each connection until killed, using its scope for commands that do not give
+// one.  Changes made with the app scope are reverted by the system when the
+// server exits.
+//
+// The socket is a Unix domain socket, which only the current user may use,
+// unless it is "tcp:[address:]port".  Anyone who can reach a TCP port can
+// connect, so TCP clients must prove they know the secret in the token file.
+static int RunServer(const struct ParsedArgs * parsed_args) {
+    const char * const socket_path = parsed_args->socket_path;
+    const size_t prefix_length = strlen(kTCPSocketPrefix);
+    const bool tcp = 0 == strncmp(socket_path, kTCPSocketPrefix,
+                                  prefix_length);
+    struct Server server = {
+        .scope = parsed_args->scope,
+        .authenticate = tcp,
+    };
+    if (tcp && !ReadToken(stderr, parsed_args->token_path, server.token)) {
+        return EXIT_FAILURE;
+    }
+    const int fd = tcp ? ListenOnTCPSocket(socket_path + prefix_length)
+                       : ListenOnUnixSocket(socket_path);
+    if (fd < 0) {
+        return EXIT_FAILURE;
+    }
+    // Clients that disconnect early shouldn't kill the server.
+    signal(SIGPIPE, SIG_IGN);
+
+    server.listener = fd;
+    for (size_t i = 0; i < kMaxClients; ++i) {
+        server.clients[i].fd = -1;
+    }
+    CGDisplayRegisterReconfigurationCallback(InvalidateOnReconfiguration,
+                                             &server.state);
+
+    const int status = ServeClients(&server);
+
+    CGDisplayRemoveReconfigurationCallback(InvalidateOnReconfiguration,
+                                           &server.state);
+    for (size_t i = 0; i < kMaxClients; ++i) {
+        if (server.clients[i].fd >= 0) {
+            CloseClient(&server.clients[i]);
+        }
+    }
+    close(fd);
+    InvalidateDisplayState(&server.state);
+    if (!tcp) {
+        unlink(socket_path);
+    }
+    return status;
+}
+
+// Returns true if the "t" command in `next' can be set in the same
+// configuration as `batch': it uses the same flags, and both name their
+// displays by index without sharing any.  Displays named otherwise aren't
+// known to differ until they are found, so they are never coalesced.
+static bool CanCoalesce(const struct ParsedArgs * batch,
+                        const struct ParsedArgs * next) {
+    if (next->option != kOptionConfigureMode ||
+        kMaxDisplays < batch->num_modes + next->num_modes ||
+        batch->force != next->force ||
+        batch->hw_mirror != next->hw_mirror ||
+        batch->dry_run != next->dry_run ||
+        batch->max_bandwidth != next->max_bandwidth ||
+        batch->timings != next->timings ||
+        batch->low_resolution != next->low_resolution ||
+        batch->wait_timeout != next->wait_timeout ||
+        batch->scope != next->scope ||
+        batch->fade != next->fade ||
+        batch->fade_out != next->fade_out ||
+        batch->fade_in != next->fade_in ||
+        batch->num_fallbacks || next->num_fallbacks) {
+        return false;
+    }
+    for (uint32_t i = 0; i < next->num_modes; ++i) {
+        const struct ModeSpec * const spec = &next->modes[i];
+        if (spec->display.selector != kSelectDisplayIndex) {
+            return false;
+        }
+        for (uint32_t j = 0; j < batch->num_modes; ++j) {
+            if (batch->modes[j].display.selector != kSelectDisplayIndex ||
+                batch->modes[j].display_index == spec->display_index) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Prints the response for `count' pipeline commands that finished with
+// `status', and adds to the number of failures.
+static void RespondToPipeline(FILE * out, int status, uint32_t count,
+                              uint32_t * num_failed) {
+    for (uint32_t i = 0; i < count; ++i) {
+        if (status == EXIT_SUCCESS) {
+            fputs("ok\n", out);
+        } else {
+            fprintf(out, "error %d\n", status);
+        }
+    }
+    *num_failed += status == EXIT_SUCCESS ? 0 : count;
+    fflush(out);
+}
+
+// Consecutive "t" lines from the pipeline that are set together.
+struct PipelineBatch {
+    struct ParsedArgs args;  // the first line, with every line's modes
+    uint32_t num_lines;
+    uint32_t line_modes[kMaxDisplays];  // the number of modes on each line
+};
+
+// Runs and responds to the lines in `batch', if any, then empties it.  If
+// the lines are rejected together, they are run again one at a time, so that
+// each gets the status it would have had without coalescing: a bad mode on
+// one line doesn't stop the others being set.  Once the displays have been
+// reconfigured, a failure is reported on every line instead, since running
+// the lines again would find their modes already set.
+static void RunPipelineBatch(const struct Session * session,
+                             struct PipelineBatch * batch,
+                             uint32_t * num_failed) {
+    if (0 == batch->num_lines) {
+        return;
+    }
+    // A batch that is run again reports its errors line by line, so its own
+    // errors are held back until it is known whether it will be.
+    struct Session batch_session = *session;
+    char * errors = NULL;
+    size_t errors_length = 0;
+    FILE * const held = 1 < batch->num_lines
+        ? open_memstream(&errors, &errors_length) : NULL;
+    if (held) {
+        batch_session.err = held;
+    }
+    bool rejected;
+    const int status = RunCommand(&batch_session, &batch->args, &rejected);
+    const bool split = EXIT_SUCCESS != status && rejected &&
+                       1 < batch->num_lines;
+    if (held) {
+        fclose(held);
+        if (!split) {
+            fwrite(errors, 1, errors_length, session->err);
+        }
+        free(errors);
+    }
+    if (!split) {
+        RespondToPipeline(session->out, status, batch->num_lines, num_failed);
+        batch->num_lines = 0;
+        return;
+    }
+    struct ParsedArgs line = batch->args;
+    uint32_t first_mode = 0;
+    for (uint32_t i = 0; i < batch->num_lines; ++i) {
+        line.num_modes = batch->line_modes[i];
+        memcpy(line.modes, &batch->args.modes[first_mode],
+               line.num_modes * sizeof(line.modes[0]));
+        first_mode += line.num_modes;
+        RespondToPipeline(session->out, RunCommand(session, &line, NULL), 1,
+                          num_failed);
+    }
+    batch->num_lines = 0;
+}
+
+// Runs the complete lines at the start of `lines', returning the start of
+// any incomplete line that follows.  If `at_end', the remainder is a last
+// line without a newline and is run too.
+//
+// "t" commands are held back only while the lines after them are already
+// read, so that a response is never delayed waiting for more input.
+static char * RunPipelineLines(const struct Session * session, char * lines,
+                               bool at_end, uint32_t * num_failed) {
+    struct PipelineBatch batch = { .num_lines = 0 };
+    char * start = lines;
+    while (*start) {
+        char * end = strchr(start, '\n');
+        if (NULL == end && !at_end) {
             break;
+        }
+        char * const next_line = end ? end + 1 : start + strlen(start);
+        if (end) {
+            *end = '\0';
+        }
+        const char * argv[kMaxCommandArgs];
+        const int argc = SplitCommandLine(start, argv, kMaxCommandArgs);
+        start = next_line;
+        if (argc < 0) {
+            RunPipelineBatch(session, &batch, num_failed);
+            fputs("Command has too many words\n", session->err);
+            RespondToPipeline(session->out, EXIT_FAILURE, 1, num_failed);
+            continue;
+        }
+        if (argc <= 1) {
+            // Ignore blank lines.
+            continue;
+        }
 
-        case kOptionInvalid:
-            fprintf(stderr, "Invalid option: '%s'\n\n",
-                    parsed_args.literal_option);
-            ShowUsage();
+        // As for the server, discard modes made stale by changes since the
+        // last command.
+        CFRunLoopRunInMode(kCFRunLoopDefaultMode, 0, false);
+        const struct ParsedArgs parsed_args =
+            ParseArgs(session->err, argc, argv);
+        if (batch.num_lines && CanCoalesce(&batch.args, &parsed_args)) {
+            memcpy(&batch.args.modes[batch.args.num_modes], parsed_args.modes,
+                   parsed_args.num_modes * sizeof(batch.args.modes[0]));
+            batch.args.num_modes += parsed_args.num_modes;
+            batch.line_modes[batch.num_lines++] = parsed_args.num_modes;
+            continue;
+        }
+        RunPipelineBatch(session, &batch, num_failed);
+        if (parsed_args.option == kOptionConfigureMode) {
+            batch.args = parsed_args;
+            batch.line_modes[0] = parsed_args.num_modes;
+            batch.num_lines = 1;
+        } else if (!IsRunnableCommand(parsed_args.option)) {
+            fprintf(session->err, "Option '%c' is not supported in a "
+                    "pipeline\n", parsed_args.option);
+            RespondToPipeline(session->out, EXIT_FAILURE, 1, num_failed);
+        } else {
+            RespondToPipeline(session->out,
+                              RunCommand(session, &parsed_args, NULL), 1,
+                              num_failed);
+        }
+    }
+    RunPipelineBatch(session, &batch, num_failed);
+    return start;
+}
+
+// Runs the commands read from standard input, one per line, in this process,
+// so that the display list and modes are only fetched once.  Returns non-zero
+// if any command failed.
+static int RunPipeline(const struct Session * session) {
+    char buffer[kMaxCommandLength];
+    size_t length = 0;
+    uint32_t num_failed = 0;
+    // Whether the rest of an overlong line is being dropped.
+    bool discarding = false;
+    CGDisplayRegisterReconfigurationCallback(InvalidateOnReconfiguration,
+                                             session->state);
+    for (;;) {
+        const ssize_t n = read(STDIN_FILENO, &buffer[length],
+                               sizeof(buffer) - length - 1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            fprintf(session->err, "Error reading commands: %s\n",
+                    strerror(errno));
+            ++num_failed;
+        }
+        const bool at_end = n <= 0;
+        length += at_end ? 0 : (size_t) n;
+        buffer[length] = '\0';
+        if (discarding) {
+            // Drop the rest of the overlong line, up to and including its
+            // newline.
+            const char * newline = strchr(buffer, '\n');
+            const size_t dropped =
+                newline ? (size_t) (newline + 1 - buffer) : length;
+            discarding = NULL == newline;
+            length -= dropped;
+            memmove(buffer, &buffer[dropped], length + 1);
+        }
+        char * const rest =
+            RunPipelineLines(session, buffer, at_end, &num_failed);
+        length -= (size_t) (rest - buffer);
+        memmove(buffer, rest, length + 1);
+        if (at_end) {
             break;
+        }
+        if (length + 1 == sizeof(buffer)) {
+            fputs("Command too long\n", session->err);
+            RespondToPipeline(session->out, EXIT_FAILURE, 1, &num_failed);
+            discarding = true;
+            length = 0;
+        }
+    }
+    CGDisplayRemoveReconfigurationCallback(InvalidateOnReconfiguration,
+                                           session->state);
+    return num_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
 
-        case kOptionInvalidMode:
-            fputs("Invalid mode\n", stderr);
+// Default number of hosts that "f" talks to at once.
+static const unsigned long kDefaultFleetConcurrency = 32;
+
+// How long "f" allows each host to run its commands, in nanoseconds.
+static const uint64_t kFleetTimeout = 60 * 1000000000ull;
+
+enum FleetHostState {
+    kFleetHostPending = 0,
+    kFleetHostConnecting,
+    kFleetHostAuthenticating,  // waiting for the server's challenge
+    kFleetHostRunning,  // commands sent, reading their responses
+    kFleetHostDone,
+};
+
+// A host that "f" sends its commands to.
+struct FleetHost {
+    char * name;  // "host[:port]" as listed in the hosts file
+    enum FleetHostState state;
+    int fd;
+    uint64_t deadline;
+    bool failed;
+    // The authentication line and commands, pipelined in a single write.
+    char * request;
+    size_t request_length;
+    size_t sent;
+    uint32_t num_responses;
+    size_t length;
+    char line[kMaxCommandLength];
+};
+
+// The commands sent by "f" and the hosts they are sent to.
+struct Fleet {
+    FILE * out;
+    FILE * err;
+    char token[kMaxTokenLength];
+    char * commands;  // newline-terminated command lines
+    uint32_t num_commands;
+    struct FleetHost * hosts;
+    size_t num_hosts;
+};
+
+// Reads the hosts listed one per line in the file at `path'.  Blank lines and
+// text following '#' are ignored.  Returns false on failure.
+static bool ReadFleetHosts(FILE * err, const char * path,
+                           struct Fleet * fleet) {
+    FILE * file = fopen(path, "r");
+    if (NULL == file) {
+        fprintf(err, "Could not open hosts file \"%s\": %s\n", path,
+                strerror(errno));
+        return false;
+    }
+    size_t capacity = 0;
+    char line[NI_MAXHOST];
+    bool valid = true;
+    while (valid && fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "#")] = '\0';
+        const char * argv[kMaxCommandArgs];
+        const int argc = SplitCommandLine(line, argv, kMaxCommandArgs);
+        if (argc < 0) {
+            fprintf(err, "Hosts file \"%s\" has a line with too many words\n",
+                    path);
+            valid = false;
+            break;
+        }
+        if (argc <= 1) {
+            continue;
+        }
+        if (fleet->num_hosts == capacity) {
+            capacity = capacity ? 2 * capacity : 64;
+            struct FleetHost * hosts =
+                realloc(fleet->hosts, capacity * sizeof(*hosts));
+            if (NULL == hosts) {
+                fputs("Out of memory\n", err);
+                valid = false;
+                break;
+            }
+            fleet->hosts = hosts;
+        }
+        struct FleetHost * host = &fleet->hosts[fleet->num_hosts];
+        memset(host, 0, sizeof(*host));
+        host->fd = -1;
+        host->name = strdup(argv[1]);
+        if (NULL == host->name) {
+            fputs("Out of memory\n", err);
+            valid = false;
             break;
+        }
+        ++fleet->num_hosts;
+    }
+    fclose(file);
+    if (valid && 0 == fleet->num_hosts) {
+        fprintf(err, "Hosts file \"%s\" does not list any hosts\n", path);
+        valid = false;
+    }
+    return valid;
+}
 
-        case kOptionConfigureMode:
-            return ConfigureMode(&parsed_args);
+// Joins the command words in `parsed_args' into newline-terminated lines for
+// the server, splitting commands at ";" words.  Returns false on failure.
+static bool BuildFleetCommands(FILE * err,
+                               const struct ParsedArgs * parsed_args,
+                               struct Fleet * fleet) {
+    size_t capacity = 1;
+    for (int i = 0; i < parsed_args->command_argc; ++i) {
+        capacity += strlen(parsed_args->command[i]) + 1;
+    }
+    char * commands = fleet->commands = calloc(capacity, 1);
+    if (NULL == commands) {
+        fputs("Out of memory\n", err);
+        return false;
+    }
+    size_t length = 0;
+    size_t line_start = 0;
+    for (int i = 0; i <= parsed_args->command_argc; ++i) {
+        const bool end = i == parsed_args->command_argc ||
+                         0 == strcmp(parsed_args->command[i], ";");
+        if (!end) {
+            const char * word = parsed_args->command[i];
+            if (length != line_start) {
+                commands[length++] = ' ';
+            }
+            memcpy(&commands[length], word, strlen(word));
+            length += strlen(word);
+            continue;
+        }
+        if (length == line_start) {
+            continue;
+        }
+        if (kMaxCommandLength <= length - line_start + 1) {
+            fputs("Command too long\n", err);
+            return false;
+        }
+        commands[length++] = '\n';
+        line_start = length;
+        ++fleet->num_commands;
+    }
+    if (0 == fleet->num_commands) {
+        fputs("Missing command\n", err);
+        return false;
+    }
+    return true;
+}
 
-        case kOptionHelp:
-            ShowUsage();
-            return EXIT_SUCCESS;
+// Stops talking to `host', reporting `error' unless it is NULL.
+static void FinishFleetHost(struct Fleet * fleet, struct FleetHost * host,
+                            const char * error) {
+    if (error) {
+        fprintf(fleet->err, "%s: %s\n", host->name, error);
+        host->failed = true;
+    }
+    if (0 <= host->fd) {
+        close(host->fd);
+        host->fd = -1;
+    }
+    free(host->request);
+    host->request = NULL;
+    host->state = kFleetHostDone;
+}
 
-        case kOptionSupportedModes:
-            return PrintModesForAllDisplays();
+// Starts connecting to `host' without waiting for the connection.
+static void ConnectFleetHost(struct Fleet * fleet, struct FleetHost * host) {
+    host->deadline = GetMonotonicNanoseconds() + kFleetTimeout;
+    char name[NI_MAXHOST];
+    const char * port;
+    if (!SplitHostPort(host->name, kDefaultFleetPort, name, &port)) {
+        FinishFleetHost(fleet, host, "host name too long");
+        return;
+    }
+    const struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+    };
+    struct addrinfo * addresses;
+    const int e = getaddrinfo(name, port, &hints, &addresses);
+    if (e) {
+        FinishFleetHost(fleet, host, gai_strerror(e));
+        return;
+    }
+    int error = 0;
+    for (struct addrinfo * a = addresses; a && host->fd < 0; a = a->ai_next) {
+        const int fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd < 0 || fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+            error = errno;
+        } else if (0 == connect(fd, a->ai_addr, a->ai_addrlen)) {
+            host->fd = fd;
+            host->state = kFleetHostAuthenticating;
+            continue;
+        } else if (errno == EINPROGRESS) {
+            host->fd = fd;
+            host->state = kFleetHostConnecting;
+            continue;
+        } else {
+            error = errno;
+        }
+        if (0 <= fd) {
+            close(fd);
+        }
+    }
+    freeaddrinfo(addresses);
+    if (host->fd < 0) {
+        FinishFleetHost(fleet, host, strerror(error));
+    }
+}
 
-        case kOptionVersion:
-            printf("%s\nCopyright 2019-2023 Dean Scarff\n", kProgramVersion);
-            return EXIT_SUCCESS;
+// Answers the server's challenge and queues the commands after the answer, so
+// that they are all sent at once.
+static void AnswerFleetChallenge(struct Fleet * fleet, struct FleetHost * host,
+                                 const char * line) {
+    static const char kChallengePrefix[] = "challenge ";
+    const size_t prefix_length = strlen(kChallengePrefix);
+    if (0 != strncmp(line, kChallengePrefix, prefix_length)) {
+        FinishFleetHost(fleet, host, "not a displaymode server");
+        return;
+    }
+    char response[kAuthResponseHexLength];
+    GetAuthResponse(fleet->token, line + prefix_length, response);
+    const size_t capacity = strlen(response) + strlen(fleet->commands) + 7;
+    host->request = malloc(capacity);
+    if (NULL == host->request) {
+        FinishFleetHost(fleet, host, "out of memory");
+        return;
+    }
+    const int n = snprintf(host->request, capacity, "auth %s\n%s", response,
+                           fleet->commands);
+    host->request_length = (size_t) n;
+    host->sent = 0;
+    host->state = kFleetHostRunning;
+}
+
+// Handles one line received from `host'.  The output of every command is
+// printed, followed by its "ok" or "error <status>" line.
+static void HandleFleetLine(struct Fleet * fleet, struct FleetHost * host,
+                            const char * line) {
+    if (host->state == kFleetHostAuthenticating) {
+        AnswerFleetChallenge(fleet, host, line);
+        return;
+    }
+    fprintf(fleet->out, "%s: %s\n", host->name, line);
+    const bool ok = 0 == strcmp(line, "ok");
+    const bool error = 0 == strncmp(line, "error ", strlen("error "));
+    if (ok || error) {
+        host->failed |= error;
+        if (++host->num_responses == fleet->num_commands) {
+            FinishFleetHost(fleet, host, NULL);
+        }
+    }
+}
+
+// Reads from `host' and handles each complete line.
+static void ReadFleetHost(struct Fleet * fleet, struct FleetHost * host) {
+    const size_t capacity = sizeof(host->line) - host->length;
+    const ssize_t n = read(host->fd, &host->line[host->length], capacity - 1);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    if (n <= 0) {
+        FinishFleetHost(fleet, host,
+                        n ? strerror(errno) : "connection closed");
+        return;
+    }
+    host->length += (size_t) n;
+    host->line[host->length] = '\0';
+
+    char * start = host->line;
+    char * newline;
+    while (host->state != kFleetHostDone &&
+           (newline = strchr(start, '\n'))) {
+        *newline = '\0';
+        HandleFleetLine(fleet, host, start);
+        start = newline + 1;
+    }
+    host->length -= (size_t) (start - host->line);
+    if (host->length + 1 == sizeof(host->line)) {
+        // Print overlong lines in pieces.
+        HandleFleetLine(fleet, host, host->line);
+        host->length = 0;
+    }
+    memmove(host->line, start, host->length);
+}
+
+// Sends as much of the pending request to `host' as the socket accepts.
+static void WriteFleetHost(struct Fleet * fleet, struct FleetHost * host) {
+    const ssize_t n = write(host->fd, &host->request[host->sent],
+                            host->request_length - host->sent);
+    if (n < 0 && errno != EAGAIN && errno != EINTR) {
+        FinishFleetHost(fleet, host, strerror(errno));
+    } else if (0 < n) {
+        host->sent += (size_t) n;
+    }
+}
+
+// Checks whether a connection started by ConnectFleetHost succeeded.
+static void FinishConnectingFleetHost(struct Fleet * fleet,
+                                      struct FleetHost * host) {
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (getsockopt(host->fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0) {
+        error = errno;
+    }
+    if (error) {
+        FinishFleetHost(fleet, host, strerror(error));
+    } else {
+        host->state = kFleetHostAuthenticating;
+    }
+}
 
+// Returns the poll events awaited for `host'.
+static short GetFleetHostEvents(const struct FleetHost * host) {
+    switch (host->state) {
+        case kFleetHostConnecting:
+            return POLLOUT;
+        case kFleetHostRunning:
+            return POLLIN | (host->sent < host->request_length ? POLLOUT : 0);
+        case kFleetHostAuthenticating:
         default:
+            return POLLIN;
+    }
+}
+
+// Talks to up to `concurrency' hosts at once until every host has finished.
+static int ServeFleet(struct Fleet * fleet, size_t concurrency) {
+    struct pollfd * fds = calloc(concurrency, sizeof(*fds));
+    struct FleetHost ** active = calloc(concurrency, sizeof(*active));
+    if (NULL == fds || NULL == active) {
+        free(fds);
+        free(active);
+        fputs("Out of memory\n", fleet->err);
+        return EXIT_FAILURE;
+    }
+    size_t next = 0;
+    size_t num_active = 0;
+    while (next < fleet->num_hosts || num_active) {
+        while (num_active < concurrency && next < fleet->num_hosts) {
+            struct FleetHost * host = &fleet->hosts[next++];
+            ConnectFleetHost(fleet, host);
+            if (host->state != kFleetHostDone) {
+                active[num_active++] = host;
+            }
+        }
+
+        const uint64_t now = GetMonotonicNanoseconds();
+        uint64_t timeout = kFleetTimeout;
+        for (size_t i = 0; i < num_active; ++i) {
+            const uint64_t remaining =
+                active[i]->deadline > now ? active[i]->deadline - now : 0;
+            timeout = remaining < timeout ? remaining : timeout;
+            fds[i] = (struct pollfd) {
+                .fd = active[i]->fd, .events = GetFleetHostEvents(active[i]),
+            };
+        }
+        if (num_active &&
+            poll(fds, (nfds_t) num_active, (int) (timeout / 1000000)) < 0 &&
+            errno != EINTR) {
+            fprintf(fleet->err, "Error polling sockets: %s\n",
+                    strerror(errno));
             break;
+        }
+
+        const uint64_t polled = GetMonotonicNanoseconds();
+        size_t num_remaining = 0;
+        for (size_t i = 0; i < num_active; ++i) {
+            struct FleetHost * host = active[i];
+            const short revents = fds[i].revents;
+            if (host->state == kFleetHostConnecting && revents) {
+                FinishConnectingFleetHost(fleet, host);
+            } else {
+                if (revents & POLLOUT) {
+                    WriteFleetHost(fleet, host);
+                }
+                if (host->state != kFleetHostDone &&
+                    (revents & (POLLIN | POLLHUP | POLLERR))) {
+                    ReadFleetHost(fleet, host);
+                }
+            }
+            if (host->state != kFleetHostDone && host->deadline <= polled) {
+                FinishFleetHost(fleet, host, "timed out");
+            }
+            if (host->state != kFleetHostDone) {
+                active[num_remaining++] = host;
+            }
+        }
+        num_active = num_remaining;
     }
-    return EXIT_FAILURE;
+    for (size_t i = 0; i < num_active; ++i) {
+        FinishFleetHost(fleet, active[i], "not finished");
+    }
+    free(fds);
+    free(active);
+
+    size_t num_succeeded = 0;
+    for (size_t i = 0; i < fleet->num_hosts; ++i) {
+        num_succeeded += fleet->hosts[i].state == kFleetHostDone &&
+                         !fleet->hosts[i].failed;
+    }
+    fprintf(fleet->err, "%zu of %zu hosts succeeded\n", num_succeeded,
+            fleet->num_hosts);
+    return num_succeeded == fleet->num_hosts ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Sends the commands in `parsed_args' to the "s tcp:" server on every host in
+// its hosts file.  Each host's commands are pipelined over one connection,
+// and up to --concurrency hosts are handled at once, so that the whole fleet
+// takes about as long as its slowest host.  Fails if any command fails on any
+// host.
+static int RunFleet(const struct Session * session,
+                    const struct ParsedArgs * parsed_args) {
+    struct Fleet fleet = { .out = session->out, .err = session->err };
+    int status = EXIT_FAILURE;
+    if (ReadToken(session->err, parsed_args->token_path, fleet.token) &&
+        BuildFleetCommands(session->err, parsed_args, &fleet) &&
+        ReadFleetHosts(session->err, parsed_args->hosts_path, &fleet)) {
+        // Servers that reject the secret close the connection early.
+        signal(SIGPIPE, SIG_IGN);
+        const size_t concurrency = parsed_args->concurrency
+            ? parsed_args->concurrency : kDefaultFleetConcurrency;
+        status = ServeFleet(&fleet, concurrency < fleet.num_hosts
+                                        ? concurrency : fleet.num_hosts);
+    }
+    for (size_t i = 0; i < fleet.num_hosts; ++i) {
+        free(fleet.hosts[i].name);
+    }
+    free(fleet.hosts);
+    free(fleet.commands);
+    return status;
+}
+
+int main(int argc, const char * argv[]) {
+    const struct ParsedArgs parsed_args = ParseArgs(stderr, argc, argv);
+    struct DisplayState state = { 0 };
+    const struct Session session = {
+        .out = stdout,
+        .err = stderr,
+        .state = &state,
+    };
+    const int status = RunCommand(&session, &parsed_args, NULL);
+    InvalidateDisplayState(&state);
+    return status;
 }